@@ -1,122 +1,580 @@
-﻿#include"ConcurrentAlloc.h"
+﻿#include "ConcurrentAllocator.h"
 
-// ntimes 一轮申请和释放内存的次数
-// rounds 轮次
-void BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds)
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#if defined(__linux__)
+	#include <sys/wait.h>
+#endif
+
+// 多种负载、多种线程数下对比内存池和系统malloc，结果按CSV输出：
+//	workload,allocator,threads,ops,seconds,mops,p50_ns,p99_ns,p999_ns,peak_rss_mb
+// 计时用steady_clock的墙上时间；每16次操作取1次单独计时，统计单次操作延迟的分位数
+// Linux下每一组(负载, 分配器, 线程数)在fork出的子进程中跑，峰值RSS(VmHWM)互不影响
+//
+// 用法：Benchmark [每个线程的操作数] [最大线程数]
+
+typedef std::chrono::steady_clock Clock;
+
+static inline uint64_t NowNs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// 线程各自的随机数，xorshift64*比<random>快得多，不会掩盖分配器本身的开销
+static inline uint64_t NextRand(uint64_t& state)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 2685821657736338717ULL;
+}
+
+// [lo, hi]之间的随机大小
+static inline size_t RandSize(uint64_t& state, size_t lo, size_t hi)
 {
-	std::vector<std::thread> vthread(nworks);
-	size_t malloc_costtime = 0;
-	size_t free_costtime = 0;
+	return lo + (size_t)(NextRand(state) % (hi - lo + 1));
+}
+
+////////////////////////////////////////////////////////////////////////////
+// 延迟直方图：小于16ns按1ns一档，之后每个2的幂再分16档（误差不超过1/16）
+class Histogram
+{
+private:
+	static const size_t SUB_BITS = 4;
+	static const size_t NUM_BUCKETS = 64 << SUB_BITS;
+
+	uint64_t _count[NUM_BUCKETS] = { 0 };
+	uint64_t _total = 0;
 
-	for (size_t k = 0; k < nworks; ++k)
+	static size_t BucketOf(uint64_t ns)
 	{
-		vthread[k] = std::thread([&, k]() {
-			std::vector<void*> v;
-			v.reserve(ntimes);
+		if (ns < (1u << SUB_BITS))
+			return (size_t)ns;
 
-			for (size_t j = 0; j < rounds; ++j)
-			{
-				size_t begin1 = clock();
-				for (size_t i = 0; i < ntimes; i++)
-				{
-					//v.push_back(malloc(16));
-					v.push_back(malloc((16 + i) % 8192 + 1));
-				}
-				size_t end1 = clock();
+		size_t msb = 63;
+		while (!(ns >> msb))
+			--msb;
+		size_t sub = (size_t)(ns >> (msb - SUB_BITS)) & ((1u << SUB_BITS) - 1);
+		return ((msb - SUB_BITS + 1) << SUB_BITS) + sub;
+	}
 
-				size_t begin2 = clock();
-				for (size_t i = 0; i < ntimes; i++)
-				{
-					free(v[i]);
-				}
-				size_t end2 = clock();
-				v.clear();
+	static uint64_t ValueOf(size_t bucket)
+	{
+		if (bucket < (1u << SUB_BITS))
+			return bucket;
 
-				malloc_costtime += (end1 - begin1);
-				free_costtime += (end2 - begin2);
-			}
-			});
+		size_t msb = (bucket >> SUB_BITS) + SUB_BITS - 1;
+		size_t sub = bucket & ((1u << SUB_BITS) - 1);
+		return (uint64_t)((1u << SUB_BITS) + sub) << (msb - SUB_BITS);
 	}
 
-	for (auto& t : vthread)
+public:
+	void Add(uint64_t ns)
 	{
-		t.join();
+		++_count[BucketOf(ns)];
+		++_total;
 	}
 
-	printf("%u个线程并发执行%u轮次，每轮次malloc %u次: 花费：%u ms\n",
-		nworks, rounds, ntimes, (int)malloc_costtime);
+	void Merge(const Histogram& other)
+	{
+		for (size_t i = 0; i < NUM_BUCKETS; ++i)
+			_count[i] += other._count[i];
+		_total += other._total;
+	}
 
-	printf("%u个线程并发执行%u轮次，每轮次free %u次: 花费：%u ms\n",
-		nworks, rounds, ntimes, (int)free_costtime);
+	uint64_t Percentile(double q) const
+	{
+		if (_total == 0)
+			return 0;
 
-	printf("%u个线程并发malloc&free %u次，总计花费：%u ms\n",
-		nworks, nworks * rounds * ntimes, (int)(malloc_costtime + free_costtime));
-}
+		uint64_t target = (uint64_t)(q * (double)_total);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < NUM_BUCKETS; ++i)
+		{
+			seen += _count[i];
+			if (seen > target)
+				return ValueOf(i);
+		}
+		return ValueOf(NUM_BUCKETS - 1);
+	}
+};
+
+// 每个工作线程的上下文
+struct Worker
+{
+	Histogram _hist;
+	uint64_t _rng = 0;
+	uint64_t _ops = 0;
+
+	explicit Worker(uint64_t seed = 1)
+		: _rng(seed * 0x9E3779B97F4A7C15ULL + 1)
+	{}
+
+	// 每16次操作计时一次，其余的只计数
+	template<class Fn>
+	auto Op(Fn fn) -> decltype(fn())
+	{
+		if ((_ops++ & 15) != 0)
+			return fn();
 
+		uint64_t begin = NowNs();
+		auto ret = fn();
+		_hist.Add(NowNs() - begin);
+		return ret;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////
+// 被测的分配器，释放统一用不带大小的接口，与free对等
+// 容器负载用Allocator<T>/Resource()：系统一侧是std::allocator和new_delete_resource（本程序没有替换operator new）
+
+struct SystemMalloc
+{
+	static const char* Name() { return "glibc"; }
+	static void* Alloc(size_t size) { return malloc(size); }
+	static int Free(void* ptr) { free(ptr); return 0; }
+
+	template<class T>
+	using Allocator = std::allocator<T>;
+	static std::pmr::memory_resource* Resource() { return std::pmr::new_delete_resource(); }
+};
+
+struct ConcurrentPool
+{
+	static const char* Name() { return "concurrent"; }
+	static void* Alloc(size_t size) { return ConcurrentAlloc(size); }
+	static int Free(void* ptr) { ConcurrentFree(ptr); return 0; }
+
+	template<class T>
+	using Allocator = ConcurrentAllocator<T>;
+	static std::pmr::memory_resource* Resource() { return ConcurrentMemoryResource::GetInstance(); }
+};
+
+struct Result
+{
+	Histogram _hist;
+	uint64_t _ops = 0;
+	double _seconds = 0;
+};
 
-// 单轮次申请释放次数 线程数 轮次
-void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds)
+// 启动threads个线程，同时开始执行fn(worker, id)，返回从开始到全部结束的墙上时间
+template<class Fn>
+static Result RunThreads(size_t threads, Fn fn)
 {
-	std::vector<std::thread> vthread(nworks);
-	std::atomic<size_t> malloc_costtime(0);
-	std::atomic<size_t> free_costtime(0);
+	std::vector<Worker> workers;
+	for (size_t i = 0; i < threads; ++i)
+		workers.emplace_back(i + 1);
 
-	for (size_t k = 0; k < nworks; ++k)
+	std::atomic<size_t> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<std::thread> vthread;
+	for (size_t i = 0; i < threads; ++i)
 	{
-		vthread[k] = std::thread([&, k]() {
-			std::vector<void*> v;
-			v.reserve(ntimes);
+		vthread.emplace_back([&, i]() {
+			++ready;
+			while (!go.load(std::memory_order_acquire))
+				std::this_thread::yield();
+			fn(workers[i], i);
+		});
+	}
+
+	while (ready.load() != threads)
+		std::this_thread::yield();
 
-			for (size_t j = 0; j < rounds; ++j)
+	uint64_t begin = NowNs();
+	go.store(true, std::memory_order_release);
+	for (auto& t : vthread)
+		t.join();
+	uint64_t end = NowNs();
+
+	Result result;
+	result._seconds = (double)(end - begin) / 1e9;
+	for (auto& w : workers)
+	{
+		result._hist.Merge(w._hist);
+		result._ops += w._ops;
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// 负载
+
+// 均匀随机：1024个槽位，随机选一个，空的就申请(8B~8KB)，有对象就释放
+template<class A>
+static Result Uniform(size_t threads, size_t ops)
+{
+	return RunThreads(threads, [ops](Worker& w, size_t) {
+		const size_t kSlots = 1024;
+		std::vector<void*> slots(kSlots, nullptr);
+
+		for (size_t i = 0; i < ops; ++i)
+		{
+			void*& slot = slots[NextRand(w._rng) % kSlots];
+			if (slot == nullptr)
 			{
-				size_t begin1 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+				size_t size = RandSize(w._rng, 8, 8192);
+				slot = w.Op([&]() { return A::Alloc(size); });
+			}
+			else
+			{
+				void* ptr = slot;
+				w.Op([&]() { return A::Free(ptr); });
+				slot = nullptr;
+			}
+		}
+
+		for (void* ptr : slots)
+		{
+			if (ptr != nullptr)
+				A::Free(ptr);
+		}
+	});
+}
+
+// 生产者-消费者：一半线程申请，另一半线程释放，所有对象都是跨线程释放
+// 对象按64个一批通过有界队列传递
+template<class A>
+static Result ProducerConsumer(size_t threads, size_t ops)
+{
+	const size_t kBatch = 64;
+	const size_t kMaxQueued = 256;
+
+	size_t producers = threads / 2 > 0 ? threads / 2 : 1;
+	size_t consumers = threads > producers ? threads - producers : 1;
+	size_t per_producer = ops * (producers + consumers) / 2 / producers / kBatch;
+
+	std::mutex mtx;
+	std::vector<std::vector<void*>> queue;
+	std::atomic<size_t> producing(producers);
+
+	return RunThreads(producers + consumers, [&](Worker& w, size_t id) {
+		if (id < producers)
+		{
+			for (size_t b = 0; b < per_producer; ++b)
+			{
+				std::vector<void*> batch(kBatch);
+				for (size_t i = 0; i < kBatch; ++i)
 				{
-					//v.push_back(ConcurrentAlloc(16));
-					v.push_back(ConcurrentAlloc((16 + i) % 8192 + 1));
+					size_t size = RandSize(w._rng, 16, 512);
+					batch[i] = w.Op([&]() { return A::Alloc(size); });
 				}
-				size_t end1 = clock();
 
-				size_t begin2 = clock();
-				for (size_t i = 0; i < ntimes; i++)
+				while (true)
 				{
-					ConcurrentFree(v[i]);
+					{
+						std::unique_lock<std::mutex> lock(mtx);
+						if (queue.size() < kMaxQueued)
+						{
+							queue.push_back(std::move(batch));
+							break;
+						}
+					}
+					std::this_thread::yield();
+				}
+			}
+			--producing;
+		}
+		else
+		{
+			while (true)
+			{
+				std::vector<void*> batch;
+				{
+					std::unique_lock<std::mutex> lock(mtx);
+					if (!queue.empty())
+					{
+						batch = std::move(queue.back());
+						queue.pop_back();
+					}
+				}
+
+				if (batch.empty())
+				{
+					if (producing.load() == 0)
+					{
+						std::unique_lock<std::mutex> lock(mtx);
+						if (queue.empty())
+							break;
+					}
+					std::this_thread::yield();
+					continue;
 				}
-				size_t end2 = clock();
-				v.clear();
 
-				malloc_costtime += (end1 - begin1);
-				free_costtime += (end2 - begin2);
+				for (void* ptr : batch)
+					w.Op([&]() { return A::Free(ptr); });
 			}
+		}
+	});
+}
+
+// Larson：模拟服务器，每个线程持有一组对象，随机替换其中一个；
+// 一轮结束后线程退出，由新线程接手这组对象继续替换（对象由别的线程释放，线程不断创建/退出）
+template<class A>
+static Result Larson(size_t threads, size_t ops)
+{
+	const size_t kSlots = 1000;
+	const size_t kRounds = 10;
+
+	std::vector<std::vector<void*>> sets(threads, std::vector<void*>(kSlots));
+	uint64_t rng = 42;
+	for (auto& set : sets)
+	{
+		for (auto& ptr : set)
+			ptr = A::Alloc(RandSize(rng, 16, 1024));
+	}
+
+	Result result = RunThreads(threads, [&](Worker& w, size_t id) {
+		std::vector<void*>& set = sets[id];
+		for (size_t round = 0; round < kRounds; ++round)
+		{
+			// 每一轮由一个新线程执行
+			std::thread t([&]() {
+				for (size_t i = 0; i < ops / kRounds / 2; ++i)
+				{
+					void*& slot = set[NextRand(w._rng) % kSlots];
+					void* ptr = slot;
+					w.Op([&]() { return A::Free(ptr); });
+
+					size_t size = RandSize(w._rng, 16, 1024);
+					slot = w.Op([&]() { return A::Alloc(size); });
+				}
 			});
+			t.join();
+		}
+	});
+
+	for (auto& set : sets)
+	{
+		for (void* ptr : set)
+			A::Free(ptr);
 	}
+	return result;
+}
 
-	for (auto& t : vthread)
+// 大对象：256KB~4MB，既有走PageCache的也有直接向系统申请的
+template<class A>
+static Result LargeObjects(size_t threads, size_t ops)
+{
+	return RunThreads(threads, [ops](Worker& w, size_t) {
+		const size_t kSlots = 16;
+		std::vector<void*> slots(kSlots, nullptr);
+
+		// 大对象的操作慢得多，次数按比例减少
+		for (size_t i = 0; i < ops / 64; ++i)
+		{
+			void*& slot = slots[NextRand(w._rng) % kSlots];
+			if (slot != nullptr)
+			{
+				void* ptr = slot;
+				w.Op([&]() { return A::Free(ptr); });
+			}
+
+			size_t size = RandSize(w._rng, 256 * 1024, 4 * 1024 * 1024);
+			slot = w.Op([&]() { return A::Alloc(size); });
+			memset(slot, 0, 4096);
+		}
+
+		for (void* ptr : slots)
+		{
+			if (ptr != nullptr)
+				A::Free(ptr);
+		}
+	});
+}
+
+// 长生命周期：每个线程维持一个先进先出的存活集合，每次释放最老的对象、申请一个新的
+// 对象在内存中停留很久，考察碎片和缓存的长期表现
+template<class A>
+static Result Churn(size_t threads, size_t ops)
+{
+	return RunThreads(threads, [ops](Worker& w, size_t) {
+		const size_t kLive = 32 * 1024;
+		std::vector<void*> ring(kLive);
+		for (auto& ptr : ring)
+			ptr = A::Alloc(RandSize(w._rng, 16, 4096));
+
+		size_t head = 0;
+		for (size_t i = 0; i < ops / 2; ++i)
+		{
+			void* ptr = ring[head];
+			w.Op([&]() { return A::Free(ptr); });
+
+			size_t size = RandSize(w._rng, 16, 4096);
+			ring[head] = w.Op([&]() { return A::Alloc(size); });
+			head = (head + 1) % kLive;
+		}
+
+		for (void* ptr : ring)
+			A::Free(ptr);
+	});
+}
+
+// 节点容器：每个线程一个容器，在kKeys个键里随机选一个，不在就插入，在就删除
+// 每次操作申请或释放一个节点，计时包括容器本身的查找和调整
+template<class Map>
+static void MapOps(Worker& w, Map& m, size_t ops)
+{
+	const uint64_t kKeys = 64 * 1024;
+	for (size_t i = 0; i < ops; ++i)
 	{
-		t.join();
+		uint64_t key = NextRand(w._rng) % kKeys;
+		w.Op([&]() {
+			auto it = m.find(key);
+			if (it == m.end())
+				m.emplace(key, i);
+			else
+				m.erase(it);
+			return 0;
+		});
 	}
+}
+
+template<class A>
+static Result NodeMap(size_t threads, size_t ops)
+{
+	return RunThreads(threads, [ops](Worker& w, size_t) {
+		typedef std::pair<const uint64_t, uint64_t> Value;
+		std::map<uint64_t, uint64_t, std::less<uint64_t>, typename A::template Allocator<Value>> m;
+		MapOps(w, m, ops);
+	});
+}
+
+template<class A>
+static Result NodeUnorderedMap(size_t threads, size_t ops)
+{
+	return RunThreads(threads, [ops](Worker& w, size_t) {
+		typedef std::pair<const uint64_t, uint64_t> Value;
+		std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+			typename A::template Allocator<Value>> m;
+		MapOps(w, m, ops);
+	});
+}
+
+// pmr容器通过memory_resource申请节点，多一次虚函数调用
+template<class A>
+static Result PmrMap(size_t threads, size_t ops)
+{
+	return RunThreads(threads, [ops](Worker& w, size_t) {
+		std::pmr::map<uint64_t, uint64_t> m(A::Resource());
+		MapOps(w, m, ops);
+	});
+}
+
+// 链表当队列用：保持kLive个节点，尾部插入、头部删除，节点先进先出
+template<class A>
+static Result NodeList(size_t threads, size_t ops)
+{
+	return RunThreads(threads, [ops](Worker& w, size_t) {
+		const size_t kLive = 4096;
+		std::list<uint64_t, typename A::template Allocator<uint64_t>> l(kLive);
+
+		for (size_t i = 0; i < ops / 2; ++i)
+		{
+			w.Op([&]() { l.pop_front(); return 0; });
+			w.Op([&]() { l.push_back(i); return 0; });
+		}
+	});
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+// 进程的峰值RSS(MB)，拿不到时返回0
+static double PeakRssMB()
+{
+#if defined(__linux__)
+	FILE* fp = fopen("/proc/self/status", "r");
+	if (fp == nullptr)
+		return 0;
 
-	printf("%u个线程并发执行%u轮次，每轮次concurrent alloc %u次: 花费：%u ms\n",
-		nworks, rounds, ntimes, (size_t)malloc_costtime);
+	char line[256];
+	long kb = 0;
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+			break;
+	}
+	fclose(fp);
+	return kb / 1024.0;
+#else
+	return 0;
+#endif
+}
 
-	printf("%u个线程并发执行%u轮次，每轮次concurrent dealloc %u次: 花费：%u ms\n",
-		nworks, rounds, ntimes, (size_t)free_costtime);
+typedef Result (*WorkloadFn)(size_t threads, size_t ops);
 
-	printf("%u个线程并发concurrent alloc&dealloc %u次，总计花费：%u ms\n",
-		nworks, nworks * rounds * ntimes, (size_t)(malloc_costtime + free_costtime));
+static void Report(const char* workload, const char* allocator, size_t threads, const Result& r)
+{
+	printf("%s,%s,%zu,%llu,%.4f,%.3f,%llu,%llu,%llu,%.1f\n",
+		workload, allocator, threads, (unsigned long long)r._ops, r._seconds,
+		r._seconds > 0 ? (double)r._ops / r._seconds / 1e6 : 0.0,
+		(unsigned long long)r._hist.Percentile(0.50),
+		(unsigned long long)r._hist.Percentile(0.99),
+		(unsigned long long)r._hist.Percentile(0.999),
+		PeakRssMB());
+	fflush(stdout);
 }
 
-int main()
+// Linux下在子进程里跑，峰值RSS只包含这一组；其它平台直接在本进程里跑
+static void RunOne(const char* workload, const char* allocator, WorkloadFn fn, size_t threads, size_t ops)
 {
+#if defined(__linux__)
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		Report(workload, allocator, threads, fn(threads, ops));
+		_exit(0);
+	}
+	else if (pid > 0)
+	{
+		int status = 0;
+		waitpid(pid, &status, 0);
+		return;
+	}
+#endif
+	Report(workload, allocator, threads, fn(threads, ops));
+}
+
+int main(int argc, char* argv[])
+{
+	size_t ops = argc > 1 ? (size_t)strtoull(argv[1], nullptr, 10) : 200000;
+	size_t max_threads = argc > 2 ? (size_t)strtoull(argv[2], nullptr, 10) : 8;
+
+	struct Workload
+	{
+		const char* _name;
+		WorkloadFn _system;
+		WorkloadFn _pool;
+	};
 
-	std::atomic<size_t> x = 0;
-	size_t n = 1000;
-	cout << "==========================================================" << endl;
-	BenchmarkConcurrentMalloc(n, 4, 10);
-	cout << endl << endl;
+	const Workload workloads[] = {
+		{ "uniform", Uniform<SystemMalloc>, Uniform<ConcurrentPool> },
+		{ "producer_consumer", ProducerConsumer<SystemMalloc>, ProducerConsumer<ConcurrentPool> },
+		{ "larson", Larson<SystemMalloc>, Larson<ConcurrentPool> },
+		{ "large", LargeObjects<SystemMalloc>, LargeObjects<ConcurrentPool> },
+		{ "churn", Churn<SystemMalloc>, Churn<ConcurrentPool> },
+		{ "std_map", NodeMap<SystemMalloc>, NodeMap<ConcurrentPool> },
+		{ "std_unordered_map", NodeUnorderedMap<SystemMalloc>, NodeUnorderedMap<ConcurrentPool> },
+		{ "std_list", NodeList<SystemMalloc>, NodeList<ConcurrentPool> },
+		{ "pmr_map", PmrMap<SystemMalloc>, PmrMap<ConcurrentPool> },
+	};
 
-	BenchmarkMalloc(n, 4, 10);
-	cout << "==========================================================" << endl;
+	printf("workload,allocator,threads,ops,seconds,mops,p50_ns,p99_ns,p999_ns,peak_rss_mb\n");
+	for (const Workload& w : workloads)
+	{
+		for (size_t threads = 1; threads <= max_threads; threads *= 2)
+		{
+			RunOne(w._name, SystemMalloc::Name(), w._system, threads, ops);
+			RunOne(w._name, ConcurrentPool::Name(), w._pool, threads, ops);
+		}
+	}
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,35 +1,49 @@
 ﻿#include "CentralCache.h"
 #include "PageCache.h"
+#include "MallocStats.h"
 
-CentralCache CentralCache::_instance_central;
+std::atomic<CentralCache*> CentralCache::_instances[MAX_NUMA_NODES];
+
+CentralCache* CentralCache::CreateInstance(size_t node)
+{
+	assert(node < MAX_NUMA_NODES);
+
+	alignas(CentralCache) static char storage[MAX_NUMA_NODES][sizeof(CentralCache)];
+	static std::mutex mtx;
+
+	std::unique_lock<std::mutex> lock(mtx);
+	CentralCache* instance = _instances[node].load(std::memory_order_relaxed);
+	if (instance == nullptr)
+	{
+		instance = new(storage[node]) CentralCache(node);
+		_instances[node].store(instance, std::memory_order_release);
+	}
+	return instance;
+}
 
 // 获得一个非空的span
-Span* CentralCache::GetNonNullOneSpan(SpanList& list, size_t size)
+Span* CentralCache::GetNonNullOneSpan(CentralSpanLists& lists, size_t size)
 {
-	 // & list 是 _span_lists[index]
-	 // 查看当前的spanlist中还有没有 拥有未分配对象的span
-	Span* it = list.Begin();
-	while (it != list.End())
+	// 从分配得最满的一档开始找，找到的第一个就是要的span
+	for (size_t i = CentralSpanLists::NUM_OCCUPANCY; i > 0; --i)
 	{
-		if (it->_free_list != nullptr)
-		{
-			return it;
-		}
-		else
+		SpanList& list = lists._partial[i - 1];
+		if (!list.Empty())
 		{
-			it = it->_next;
+			return list.Begin();
 		}
 	}
 
 	// 先把central cache的桶锁解掉，这样如果其它线程释放内存对象回来，不会被阻塞
-	list._mtx.unlock();
+	lists._mtx.unlock();
 
-	// 走到这说明没有空闲的span了，只能向page cache要
-	PageCache::GetInstance()->_page_mtx.lock();
-	Span* span = PageCache::GetInstance()->NewSpan(SizeClass::NumMovePage(size));
+	// 走到这说明没有空闲的span了，只能向本节点的page cache要
+	PageCache* page_cache = PageCache::GetInstance(_node);
+	page_cache->_page_mtx.lock();
+	Span* span = page_cache->NewSpan(SizeClass::Info(SizeClass::Index(size))._pages);
 	span->_is_use = true;
 	span->_obj_size = size;
-	PageCache::GetInstance()->_page_mtx.unlock();
+	page_cache->_page_mtx.unlock();
 
 	// 对获取span进行切分，不需要加锁，因为这会其它线程访问不到这个span（没挂到list上）
 
@@ -40,13 +54,14 @@ Span* CentralCache::GetNonNullOneSpan(SpanList& list, size_t size)
 
 	// 把大块内存切成自由链表链接起来
 	//	 先切下一块做头，方便尾插（分配自由链表的内存对象时，从start-》end方向
+	//	 bytes不一定是size的整数倍，尾部不够一个对象的部分不切
 	span->_free_list = start;
 	start += size;
 	void* tail = span->_free_list;
-	int debug_i = 1;	// 调试代码所用
-	while (start < end)
+	span->_obj_num = 1;
+	while (start + size <= end)
 	{
-		++debug_i;
+		++span->_obj_num;
 		NextObj(tail) = start;
 		tail = start; // tail = NextObj(tail);
 		start += size;
@@ -54,8 +69,8 @@ Span* CentralCache::GetNonNullOneSpan(SpanList& list, size_t size)
 	NextObj(tail) = nullptr;
 
 	// 切好span后，需要把span挂到桶里，需要加锁了
-	list._mtx.lock();
-	list.PushFront(span);
+	lists._mtx.lock();
+	lists.ListOf(span).PushFront(span);
 
 	return span;
 }
@@ -64,11 +79,23 @@ Span* CentralCache::GetNonNullOneSpan(SpanList& list, size_t size)
 size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t batch_num, size_t size)
 {
 	size_t index = SizeClass::Index(size);
+
+	// 中转缓存里只放整批(>= NumMoveSize个)对象，慢开始阶段要的少，仍然从span里切
+	if (batch_num >= SizeClass::Info(index)._batch)
+	{
+		size_t n = _transfer_caches[index].Remove(start, end);
+		if (n > 0)
+		{
+			return n;
+		}
+	}
+
 	_span_lists[index]._mtx.lock();
 
 	Span* span = GetNonNullOneSpan(_span_lists[index], size);
 	assert(span);
 	assert(span->_free_list);
+	SpanList* old_list = &_span_lists[index].ListOf(span);
 
 	// 从span中获取batch_num个对象
 	// 如果不够batch_num个，有多少那多少
@@ -86,14 +113,51 @@ size_t CentralCache::FetchRangeObj(void*& start, void*& end, size_t batch_num, s
 	NextObj(end) = nullptr;
 	span->_use_count += actual_num;
 
+	// 分配得更满了，可能要换到更高的一档或者_full
+	SpanList* new_list = &_span_lists[index].ListOf(span);
+	if (new_list != old_list)
+	{
+		old_list->Erase(span);
+		new_list->PushFront(span);
+	}
+
 	_span_lists[index]._mtx.unlock();
 
 	return actual_num;
 }
 
+void CentralCache::ReleaseRangeObj(void* start, void* end, size_t n, size_t size)
+{
+	size_t index = SizeClass::Index(size);
+
+	// 按桶的参数判断，Deallocate传下来的可能是未对齐的size
+	// 多节点时别的节点的对象不能进本节点的中转缓存，否则会被本节点的线程拿去用
+	// 只收正好一整批的：FetchRangeObj取出一批时不会拿到比_batch更多的对象
+	if (n == SizeClass::Info(index)._batch
+		&& (Numa::NumNodes() <= 1 || AllLocal(start, n))
+		&& _transfer_caches[index].Insert(start, end, n))
+	{
+		return;
+	}
+
+	ReleaseListToSpans(start, size);
+}
+
+bool CentralCache::AllLocal(void* start, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (PageCache::GetInstance()->MapObjectToSpan(start)->_node != _node)
+			return false;
+		start = NextObj(start);
+	}
+	return true;
+}
+
 void CentralCache::ReleaseListToSpans(void* start, size_t size)
 {
 	size_t index = SizeClass::Index(size);
+	void* foreign = nullptr;	// 属于其它节点的对象
 	
 	_span_lists[index]._mtx.lock();
 
@@ -102,6 +166,15 @@ void CentralCache::ReleaseListToSpans(void* start, size_t size)
 		void* next = NextObj(start);
 
 		Span* span = PageCache::GetInstance()->MapObjectToSpan(start);
+		if (span->_node != _node)
+		{
+			NextObj(start) = foreign;
+			foreign = start;
+			start = next;
+			continue;
+		}
+
+		SpanList* old_list = &_span_lists[index].ListOf(span);
 
 		// 头插
 		NextObj(start) = span->_free_list;
@@ -112,7 +185,7 @@ void CentralCache::ReleaseListToSpans(void* start, size_t size)
 		// 这个span就可以回收给page cache
 		if (0 == span->_use_count)
 		{
-			_span_lists[index].Erase(span);
+			old_list->Erase(span);
 			span->_free_list = nullptr;
 			span->_next = nullptr;
 			span->_prev = nullptr;
@@ -121,14 +194,90 @@ void CentralCache::ReleaseListToSpans(void* start, size_t size)
 			// 这时把桶锁戒掉
 			_span_lists[index]._mtx.unlock();
 
-			PageCache::GetInstance()->_page_mtx.lock();
-			PageCache::GetInstance()->ReleaseSpanToPage(span);
-			PageCache::GetInstance()->_page_mtx.unlock();
+			PageCache* page_cache = PageCache::GetInstance(_node);
+			page_cache->_page_mtx.lock();
+			page_cache->ReleaseSpanToPage(span);
+			page_cache->_page_mtx.unlock();
 
 			_span_lists[index]._mtx.lock();
 		}
+		else
+		{
+			// 空闲对象变多，可能要从_full或者高的一档换到低的一档
+			SpanList* new_list = &_span_lists[index].ListOf(span);
+			if (new_list != old_list)
+			{
+				old_list->Erase(span);
+				new_list->PushFront(span);
+			}
+		}
 
 		start = next;
 	}
 	_span_lists[index]._mtx.unlock();
-}
\ No newline at end of file
+
+	// 转交给第一个对象所属的节点，剩下的其它节点的对象由它继续转交
+	if (foreign != nullptr)
+	{
+		size_t node = PageCache::GetInstance()->MapObjectToSpan(foreign)->_node;
+		GetInstance(node)->ReleaseListToSpans(foreign, size);
+	}
+}
+
+size_t CentralCache::Plunder(bool all)
+{
+	size_t objects = 0;
+	for (size_t i = 0; i < NUM_FREELIST; ++i)
+	{
+		TransferCache& transfer_cache = _transfer_caches[i];
+		size_t batches = all ? transfer_cache.Batches() : transfer_cache.LowWater();
+
+		// 清扫期间其它线程可能正在放入/取走，取不到就说明已经被用掉了
+		for (size_t j = 0; j < batches; ++j)
+		{
+			void* start = nullptr;
+			void* end = nullptr;
+			size_t n = transfer_cache.Remove(start, end);
+			if (n == 0)
+				break;
+
+			ReleaseListToSpans(start, SizeClass::Info(i)._size);
+			objects += n;
+		}
+
+		transfer_cache.ResetLowWater();
+	}
+
+	return objects;
+}
+
+void CentralCache::CollectStats(MallocStats& stats)
+{
+	for (size_t i = 0; i < NUM_FREELIST; ++i)
+	{
+		SizeClassStats& cls = stats._classes[i];
+		CentralSpanLists& lists = _span_lists[i];
+
+		auto add = [&](SpanList& list) {
+			for (Span* it = list.Begin(); it != list.End(); it = it->_next)
+			{
+				size_t span_bytes = it->_page_num << PAGE_SHIFT;
+				++cls._span_count;
+				cls._central_cache_objects += it->_obj_num - it->_use_count;
+				cls._span_waste_bytes += span_bytes - it->_obj_num * cls._size;
+				stats._central_span_bytes += span_bytes;
+			}
+		};
+
+		lists._mtx.lock();
+		for (size_t j = 0; j < CentralSpanLists::NUM_OCCUPANCY; ++j)
+		{
+			add(lists._partial[j]);
+		}
+		add(lists._full);
+		lists._mtx.unlock();
+
+		// 中转缓存里的对象在span看来是已经分配出去的
+		cls._transfer_cache_objects += _transfer_caches[i].Objects();
+	}
+}
@@ -1,30 +1,88 @@
 ﻿#pragma once
 
 #include "Common.h"
+#include "TransferCache.h"
+#include "Numa.h"
 
-// 整个程序一个CentralCache就行——》单例模式
+struct MallocStats;
+
+// 一个size class在CentralCache中的span
+// 按已分配对象的比例分档挂在不同的链表上，取span时从最满的一档开始找：
+//	1. 不需要再线性扫描整个链表跳过已经分配完的span，O(1)找到有空闲对象的span
+//	2. 对象尽量集中在少数span上，其余span更容易整个空出来还给PageCache
+struct CentralSpanLists
+{
+	static const size_t NUM_OCCUPANCY = 8;
+
+	SpanList _partial[NUM_OCCUPANCY];	// 还有空闲对象的span，下标越大分配得越满
+	SpanList _full;						// 对象已经全部分配出去的span
+	std::mutex _mtx;					// 桶锁
+
+	// span当前应该挂在哪个链表上
+	SpanList& ListOf(Span* span)
+	{
+		if (span->_use_count == span->_obj_num)
+		{
+			return _full;
+		}
+		return _partial[span->_use_count * NUM_OCCUPANCY / span->_obj_num];
+	}
+};
+
+// 每个NUMA节点一个CentralCache，只从本节点的PageCache获取span——》单节点时就是单例
 class CentralCache
 {
 private:
-	SpanList _span_lists[NUM_FREELIST];   // 与ThreadCache相同的映射规则
-	static CentralCache _instance_central;
+	size_t _node;									// 所在的NUMA节点
+	CentralSpanLists _span_lists[NUM_FREELIST];   // 与ThreadCache相同的映射规则
+	TransferCache _transfer_caches[NUM_FREELIST];  // 整批对象的无锁中转
+
+	static std::atomic<CentralCache*> _instances[MAX_NUMA_NODES];
 
 private:
-	CentralCache() {}
+	CentralCache(size_t node)
+		: _node(node)
+	{
+		for (size_t i = 0; i < NUM_FREELIST; ++i)
+		{
+			const SizeClassInfo& info = SizeClass::Info(i);
+			_transfer_caches[i].Init(info._size, info._batch);
+		}
+	}
 	CentralCache(const CentralCache& ) = delete;
 	CentralCache& operator=(const CentralCache& ) = delete;
 
+	static CentralCache* CreateInstance(size_t node);
+
+	// 多节点时[start, n个对象]是否都来自本节点的span，只有这样的一批才能放进本节点的中转缓存
+	bool AllLocal(void* start, size_t n);
+
 public:
-	static CentralCache* GetInstance()
+	// 第一次使用时构造，并且永不析构
+	// 全局operator new/malloc可能在其它编译单元的静态对象构造时就被调用，不能依赖静态初始化顺序
+	static CentralCache* GetInstance(size_t node = 0)
 	{
-		return &_instance_central;
+		CentralCache* instance = _instances[node].load(std::memory_order_acquire);
+		return instance != nullptr ? instance : CreateInstance(node);
 	}
 
 	// 获得一个非空的span
-	Span* GetNonNullOneSpan(SpanList& list, size_t size);
+	Span* GetNonNullOneSpan(CentralSpanLists& lists, size_t size);
 
 	//  从中心缓存中获取一部分对象给ThreadCache
 	size_t FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t size);
 
+	// ThreadCache还回来一批[start, end]共n个对象，正好一整批时优先放进中转缓存
+	void ReleaseRangeObj(void* start, void* end, size_t n, size_t size);
+
+	// 把对象还给所属的span，其它节点的对象转交给对应节点的CentralCache
 	void ReleaseListToSpans(void* start, size_t size);
+
+	// 把中转缓存里上个周期一直没被取走的批次还给span，all为true时全部还回去
+	// 空出来的span随之回到PageCache，之后才能被ReleaseFreePages还给系统；返回还回去的对象个数
+	// 内部会拿桶锁和_page_mtx，调用前不能持有_page_mtx
+	size_t Plunder(bool all = false);
+
+	// 逐个桶加锁，统计span个数、span中空闲的对象和中转缓存中的对象，累加到stats
+	void CollectStats(MallocStats& stats);
 };
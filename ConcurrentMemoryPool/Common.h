@@ -7,14 +7,18 @@
 
 #include <thread>
 #include <mutex>
+#include <atomic>
 
 #include <ctime>
+#include <cstring>
+#include <cstdint>
 #include <assert.h>
 
 #ifdef _WIN32
 	#include <Windows.h>
 #else
-	// linux
+	#include <sys/mman.h>
+	#include <unistd.h>
 #endif
 
 
@@ -30,16 +34,62 @@ static const size_t PAGE_SHIFT = 13;		 // 8*1024 一页
 typedef unsigned long long PAGE_ID;
 #elif _WIN32
 typedef size_t PAGE_ID;
-#elif
-// linux
+#else
+// linux：32/64位下统一使用64位页号，x86-64用户态地址右移PAGE_SHIFT后仍放得下
+typedef unsigned long long PAGE_ID;
 #endif
 
-inline static void* SystemAlloc(size_t kpage)
+// 直接向系统按页申请空间，返回的地址按 align_pages 页对齐
+// 返回的地址必须按 1<<PAGE_SHIFT 对齐，否则 ptr>>PAGE_SHIFT 算出的页号会落到ptr之前
+inline static void* SystemAlloc(size_t kpage, size_t align_pages = 1)
 {
 #ifdef _WIN32
-	void* ptr = VirtualAlloc(0, kpage << 13, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	// VirtualAlloc 按64KB粒度分配，天然满足8KB对齐
+	size_t bytes = kpage << PAGE_SHIFT;
+	size_t align = align_pages << PAGE_SHIFT;
+	void* ptr = VirtualAlloc(0, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+	// 对齐要求更大时，先多保留一段地址空间找到对齐的位置，释放后在该位置重新申请
+	// 两步之间地址可能被别的线程抢走，所以要重试
+	while (ptr != nullptr && ((uintptr_t)ptr & (align - 1)) != 0)
+	{
+		VirtualFree(ptr, 0, MEM_RELEASE);
+
+		char* raw = (char*)VirtualAlloc(0, bytes + align, MEM_RESERVE, PAGE_NOACCESS);
+		if (raw == nullptr)
+		{
+			ptr = nullptr;
+			break;
+		}
+		char* aligned = (char*)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+		VirtualFree(raw, 0, MEM_RELEASE);
+
+		ptr = VirtualAlloc(aligned, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (ptr == nullptr)
+			ptr = VirtualAlloc(0, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	}
 #else
-	// linux下brk mmap等
+	// linux下mmap只保证系统页(通常4KB)对齐
+	// 多映射一个对齐单位，再把首尾不对齐的部分munmap掉
+	size_t bytes = kpage << PAGE_SHIFT;
+	size_t align = align_pages << PAGE_SHIFT;
+	void* ptr = nullptr;
+
+	char* raw = (char*)mmap(nullptr, bytes + align, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw != (char*)MAP_FAILED)
+	{
+		char* aligned = (char*)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+		size_t head = aligned - raw;
+		size_t tail = align - head;
+
+		if (head > 0)
+			munmap(raw, head);
+		if (tail > 0)
+			munmap(aligned + bytes, tail);
+
+		ptr = aligned;
+	}
 #endif
 
 	if (ptr == nullptr)
@@ -48,12 +98,106 @@ inline static void* SystemAlloc(size_t kpage)
 	return ptr;
 }
 
-inline static void SystemFree(void* ptr)
+// kpage必须与SystemAlloc时的页数一致（munmap需要长度，VirtualFree不需要）
+inline static void SystemFree(void* ptr, size_t kpage)
 {
 #ifdef _WIN32
 	VirtualFree(ptr, 0, MEM_RELEASE);
 #else
-	// sbrk unmmap等
+	munmap(ptr, kpage << PAGE_SHIFT);
+#endif
+}
+
+// 把SystemAlloc得到的[ptr, ptr + old_kpage页)调整为new_kpage页，页中的数据保留
+// 返回新的起始地址（可能搬移），失败返回nullptr
+inline static void* SystemRemap(void* ptr, size_t old_kpage, size_t new_kpage)
+{
+#if defined(__linux__)
+	size_t old_bytes = old_kpage << PAGE_SHIFT;
+	size_t new_bytes = new_kpage << PAGE_SHIFT;
+
+	// 先尝试原地伸缩
+	void* ret = mremap(ptr, old_bytes, new_bytes, 0);
+	if (ret != MAP_FAILED)
+		return ret;
+
+	// 原地放不下：先占一段按页对齐的地址，再把原来的物理页整体挪过去，不拷贝数据
+	// 直接MREMAP_MAYMOVE得到的地址只保证4KB对齐
+	// 这段地址没有绑定NUMA节点，由调用方按span所属的节点重新绑定
+	void* target = nullptr;
+	try
+	{
+		target = SystemAlloc(new_kpage);
+	}
+	catch (const std::bad_alloc&)
+	{
+		return nullptr;
+	}
+
+	ret = mremap(ptr, old_bytes, new_bytes, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+	if (ret == MAP_FAILED)
+	{
+		SystemFree(target, new_kpage);
+		return nullptr;
+	}
+
+	return ret;
+#else
+	(void)ptr;
+	(void)old_kpage;
+	(void)new_kpage;
+	return nullptr;
+#endif
+}
+
+// 把[ptr, ptr + kpage页)的物理内存还给系统，但保留地址空间
+// lazy为true时用MADV_FREE：内核在内存紧张时才真正回收，期间再次写入不会缺页
+inline static void SystemRelease(void* ptr, size_t kpage, bool lazy)
+{
+#ifdef _WIN32
+	(void)lazy;
+	VirtualFree(ptr, kpage << PAGE_SHIFT, MEM_DECOMMIT);
+#else
+	int advice = MADV_DONTNEED;
+#ifdef MADV_FREE
+	if (lazy)
+		advice = MADV_FREE;
+#else
+	(void)lazy;
+#endif
+	madvise(ptr, kpage << PAGE_SHIFT, advice);
+#endif
+}
+
+// SystemRelease过的页重新投入使用前调用
+// linux下被madvise的页再次访问时内核会自动补上(全零)物理页，无需额外操作
+inline static void SystemCommit(void* ptr, size_t kpage)
+{
+#ifdef _WIN32
+	if (VirtualAlloc(ptr, kpage << PAGE_SHIFT, MEM_COMMIT, PAGE_READWRITE) == nullptr)
+		throw std::bad_alloc();
+#else
+	(void)ptr;
+	(void)kpage;
+#endif
+}
+
+// x的最低位1的下标，x不能为0
+inline static size_t CountTrailingZeros(uint64_t x)
+{
+	assert(x != 0);
+#if defined(_MSC_VER) && defined(_WIN64)
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, (unsigned long)x))
+		return index;
+	_BitScanForward(&index, (unsigned long)(x >> 32));
+	return index + 32;
+#else
+	return (size_t)__builtin_ctzll(x);
 #endif
 }
 
@@ -68,6 +212,8 @@ private:
 	void* _free_list = nullptr;
 	size_t _max_size = 1;
 	size_t _list_size = 0;
+	size_t _low_water = 0;		// 上次ClearLowWater以来链表的最短长度，这么多对象一直没被用到
+	size_t _overages = 0;		// 长度超过_max_size的次数，超过几次就缩小_max_size
 public:
 
 	void Push(void* obj)
@@ -106,6 +252,25 @@ public:
 		NextObj(end) = nullptr;
 
 		_list_size -= n;
+		if (_list_size < _low_water)
+			_low_water = _list_size;
+	}
+
+	// 头部的n个对象依次取到batch中，不需要先找到尾部再断开
+	void PopBatch(void** batch, size_t n)
+	{
+		assert(n <= _list_size);
+		void* obj = _free_list;
+		for (size_t i = 0; i < n; ++i)
+		{
+			batch[i] = obj;
+			obj = NextObj(obj);
+		}
+		_free_list = obj;
+
+		_list_size -= n;
+		if (_list_size < _low_water)
+			_low_water = _list_size;
 	}
 
 	void* Pop()
@@ -116,6 +281,8 @@ public:
 		void* obj = _free_list;
 		_free_list = NextObj(obj);
 		_list_size--;
+		if (_list_size < _low_water)
+			_low_water = _list_size;
 
 		return obj;
 	}
@@ -134,6 +301,29 @@ public:
 	{
 		return _list_size;
 	}
+
+	size_t LowWater()
+	{
+		return _low_water;
+	}
+
+	void ClearLowWater()
+	{
+		_low_water = _list_size;
+	}
+
+	size_t& Overages()
+	{
+		return _overages;
+	}
+};
+
+// 一个size class的全部参数，分配/释放时查一次表就能拿到
+struct SizeClassInfo
+{
+	uint32_t _size;		// 对齐后的对象大小
+	uint16_t _batch;	// ThreadCache一次批量向CentralCache要的对象个数上限(NumMoveSize)
+	uint16_t _pages;	// CentralCache一次向PageCache要的页数(NumMovePage)
 };
 
 // 计算对象大小的对齐映射规则
@@ -147,10 +337,16 @@ public:
 	// [1024+1,8*1024]			128byte对齐	     freelist[72,128)
 	// [8*1024+1,64*1024]		1024byte对齐     freelist[128,184)
 	// [64*1024+1,256*1024]		8*1024byte对齐   freelist[184,208)
+	//
+	// 上面的分段规则只在编译期用来生成表，运行时：
+	//	size -> index：size <= 1024 查 _small_table._index[(size + 7) >> 3]
+	//	              size >  1024 查 _large_table._index[(size + 127) >> 7]
+	//	（各区间的边界都是8/128的整数倍，所以这样取下标不会跨越两个桶）
+	//	index -> 对齐后大小、批量个数、页数：查 _class_table._info[index]
 
 	// 处理单次对齐：在对其数为 align_num 情况下，申请bytes大小的空间，计算实际返回的空间大小
 	// 为什么这样做：内存对齐的需要
-	static inline size_t _RoundUp(size_t bytes, size_t align_num)
+	static constexpr size_t _RoundUp(size_t bytes, size_t align_num)
 	{
 		return ((bytes + align_num - 1) & ~(align_num - 1));
 	}
@@ -158,47 +354,128 @@ public:
 	// 处理分段对齐
 	static inline size_t RoundUp(size_t size)
 	{
-		if (size <= 128)
-		{
-			return _RoundUp(size, 8);
-		}
-		else if (size <= 1024)
+		if (size <= MAX_BYTES)
 		{
-			return _RoundUp(size, 16);
+			return _class_table._info[Index(size)]._size;
 		}
-		else if (size <= 8*1024)
+		else
 		{
-			return _RoundUp(size, 128);
+			return _RoundUp(size, 1 << PAGE_SHIFT);
 		}
-		else if (size <= 64*1024)
+	}
+
+	// 计算映射到哪一个自由链表桶
+	static inline size_t Index(size_t bytes)
+	{
+		assert(bytes <= MAX_BYTES);
+
+		if (bytes <= SMALL_MAX)
 		{
-			return _RoundUp(size, 1024);
+			return _small_table._index[(bytes + 7) >> 3];
 		}
-		else if (size <= 256*1024)
+		else
 		{
-			return _RoundUp(size, 8*1024);
+			return _large_table._index[(bytes + 127) >> 7];
 		}
-		else
+	}
+
+	// 桶index的全部参数
+	static inline const SizeClassInfo& Info(size_t index)
+	{
+		assert(index < NUM_FREELIST);
+		return _class_table._info[index];
+	}
+
+	// Index的逆映射：自由链表桶index对应的对象大小
+	static inline size_t ClassSize(size_t index)
+	{
+		return Info(index)._size;
+	}
+
+	// 带对齐要求(align为2的幂)的申请，返回实际要申请的大小：
+	// span起始地址按页对齐，如果桶的对象大小是align的整数倍，桶内所有对象都按align对齐
+	// 所以不超过一页的对齐，取size所在的桶之后第一个对象大小是align整数倍的桶（查_align_table）
+	// 超过MAX_BYTES、小对象的桶里找不到、或者对齐超过一页时返回0，表示按整页从PageCache申请对齐的span（见ConcurrentAllocAligned）
+	// 返回值非0时，按该大小释放(ConcurrentFree(ptr, size))即可映射回申请时的桶
+	static inline size_t AlignedSize(size_t size, size_t align)
+	{
+		assert((align & (align - 1)) == 0);
+
+		if (size == 0)
+			size = 1;
+
+		if (size > MAX_BYTES)
+			return 0;
+
+		if (align <= alignof(void*))
+			return size;
+
+		if (align <= ((size_t)1 << PAGE_SHIFT))
 		{
-			return _RoundUp(size, 1 << PAGE_SHIFT);
+			size_t shift = 0;
+			while (((size_t)1 << shift) < align)
+				++shift;
+
+			uint8_t index = _align_table._index[shift][Index(size)];
+			if (index != NO_CLASS)
+				return _class_table._info[index]._size;
 		}
+
+		return 0;
 	}
 
-	// 计算在对其数为(1<<align_shift)的区间中所处的index
-	static inline size_t _Index(size_t bytes, size_t align_shift)
+	// 慢开始反馈调节 batch_num的上限值
+	static constexpr size_t NumMoveSize(size_t size)
 	{
-		return ((bytes + (1 << align_shift) - 1) >> align_shift) - 1;
+		assert(size > 0);
+
+		// [2, 512] 一次批量移动多少个对象的上限值
+		size_t num = MAX_BYTES / size;
+		if (num < 2)
+			num = 2;
+
+		if (num > 512)
+			num = 512;
+
+		return num;
 	}
 
-	// 计算映射到哪一个自由链表桶
-	static inline size_t Index(size_t bytes)
+	// 计算一次向系统申请几个页
+	static constexpr size_t NumMovePage(size_t size)
 	{
-		assert(bytes <= MAX_BYTES);
+		// ThreadCache一次向CentralCache申请大小为size对象个数的上限值
+		// 那么申请几个页与其相关
+		size_t num = NumMoveSize(size);
+		size_t n_page = num * size;
+
+		n_page >>= PAGE_SHIFT;
+		if (n_page == 0)
+			n_page = 1;
+
+		return n_page;
+	}
+
+private:
+	static const size_t SMALL_MAX = 1024;
+
+	// 以下只在编译期生成表时使用
+	// 计算在对其数为(1<<align_shift)的区间中所处的index
+	static constexpr size_t _Index(size_t bytes, size_t align_shift)
+	{
+		return ((bytes + ((size_t)1 << align_shift) - 1) >> align_shift) - 1;
+	}
 
+	// 分段规则下size对应的桶
+	static constexpr size_t _ComputeIndex(size_t bytes)
+	{
 		// 每个区间有多少自由链表
-		static int group_array[4] = { 16, 56, 56, 56 };
+		constexpr size_t group_array[4] = { 16, 56, 56, 56 };
 
-		if (bytes <= 128)
+		if (bytes == 0)
+		{
+			return 0;
+		}
+		else if (bytes <= 128)
 		{
 			return _Index(bytes, 3);
 		}
@@ -214,53 +491,113 @@ public:
 		{
 			return _Index(bytes - 8 * 1024, 10) + group_array[0] + group_array[1] + group_array[2];
 		}
-		else if (bytes <= 256 * 1024)
+		else
 		{
 			return _Index(bytes - 64 * 1024, 13) + group_array[0] + group_array[1] + group_array[2] + group_array[3];
 		}
+	}
+
+	// 分段规则下size对齐后的大小
+	static constexpr size_t _ComputeRoundUp(size_t size)
+	{
+		if (size <= 128)
+		{
+			return _RoundUp(size, 8);
+		}
+		else if (size <= 1024)
+		{
+			return _RoundUp(size, 16);
+		}
+		else if (size <= 8 * 1024)
+		{
+			return _RoundUp(size, 128);
+		}
+		else if (size <= 64 * 1024)
+		{
+			return _RoundUp(size, 1024);
+		}
 		else
 		{
-			assert(false);
+			return _RoundUp(size, 8 * 1024);
 		}
-
-		return -1;
 	}
 
-	// 慢开始反馈调节 batch_num的上限值
-	static size_t NumMoveSize(size_t size)
-	{
-		assert(size > 0);
-
-		// [2, 512] 一次批量移动多少个对象的上限值
-		int num = MAX_BYTES / size;
-		if (num < 2)
-			num = 2;
+	static const uint8_t NO_CLASS = 0xFF;
 
-		if (num > 512)
-			num = 512;
+	struct ClassTable { SizeClassInfo _info[NUM_FREELIST]; };
+	struct AlignTable { uint8_t _index[PAGE_SHIFT + 1][NUM_FREELIST]; };
+	struct SmallTable { uint8_t _index[(SMALL_MAX >> 3) + 1]; };
+	struct LargeTable { uint8_t _index[(MAX_BYTES >> 7) + 1]; };
 
-		return num;
+	static constexpr ClassTable MakeClassTable()
+	{
+		ClassTable table{};
+		for (size_t size = 8; size <= MAX_BYTES; size += 8)
+		{
+			size_t index = _ComputeIndex(size);
+			size_t align_size = _ComputeRoundUp(size);
+			table._info[index] = { (uint32_t)align_size,
+				(uint16_t)NumMoveSize(align_size), (uint16_t)NumMovePage(align_size) };
+		}
+		return table;
 	}
 
-	// 计算一次向系统申请几个页
-	static size_t NumMovePage(size_t size)
+	// _index[shift][i]：不小于桶i、且对象大小是(1 << shift)整数倍的第一个桶，没有则为NO_CLASS
+	static constexpr AlignTable MakeAlignTable()
 	{
-		// ThreadCache一次向CentralCache申请大小为size对象个数的上限值
-		// 那么申请几个页与其相关
-		size_t num = NumMoveSize(size);
-		size_t n_page = num * size;
+		ClassTable classes = MakeClassTable();
+		AlignTable table{};
+		for (size_t shift = 0; shift <= PAGE_SHIFT; ++shift)
+		{
+			uint8_t next = NO_CLASS;
+			for (size_t i = NUM_FREELIST; i > 0; --i)
+			{
+				if (classes._info[i - 1]._size % ((size_t)1 << shift) == 0)
+					next = (uint8_t)(i - 1);
+				table._index[shift][i - 1] = next;
+			}
+		}
+		return table;
+	}
 
-		n_page >>= PAGE_SHIFT;
-		if (n_page == 0)
-			n_page = 1;
+	static constexpr SmallTable MakeSmallTable()
+	{
+		SmallTable table{};
+		for (size_t i = 0; i <= (SMALL_MAX >> 3); ++i)
+		{
+			table._index[i] = (uint8_t)_ComputeIndex(i << 3);
+		}
+		return table;
+	}
 
-		return n_page;
+	static constexpr LargeTable MakeLargeTable()
+	{
+		LargeTable table{};
+		for (size_t i = 0; i <= (MAX_BYTES >> 7); ++i)
+		{
+			table._index[i] = (uint8_t)_ComputeIndex(i << 7);
+		}
+		return table;
 	}
 
+	// 类定义完整之后才能在常量表达式中调用上面的函数，所以表在类外定义
+	static const ClassTable _class_table;
+	static const SmallTable _small_table;
+	static const LargeTable _large_table;
+	static const AlignTable _align_table;
+
+	static_assert(NUM_FREELIST < NO_CLASS, "index must fit in uint8_t");
 };
 
+// 编译期生成，运行时只读
+inline constexpr SizeClass::ClassTable SizeClass::_class_table = SizeClass::MakeClassTable();
+inline constexpr SizeClass::SmallTable SizeClass::_small_table = SizeClass::MakeSmallTable();
+inline constexpr SizeClass::LargeTable SizeClass::_large_table = SizeClass::MakeLargeTable();
+inline constexpr SizeClass::AlignTable SizeClass::_align_table = SizeClass::MakeAlignTable();
 
 // 管理多个连续页大块内存的跨度结构
+struct HeapSample;
+
 struct Span
 {
 	PAGE_ID _page_id = 0; // 大块内存的起始页号
@@ -272,14 +609,25 @@ struct Span
 	size_t _use_count = 0;		// 切好小块内存，被分配给thread cache的计数
 	void* _free_list = nullptr; // 切好的小块内存的自由链表
 	size_t _obj_size = 0;       // 小块内存的大小
+	size_t _obj_num = 0;        // 切分出的小块内存总数
 
 	bool _is_use = false;		// 是否正在被使用
+	bool _is_returned = false;	// 空闲时物理页是否已经还给系统(SystemRelease)
+	bool _is_aligned = false;	// 按整页申请的对齐对象，整个span就是一个对象，_obj_size是申请的大小（可能不超过MAX_BYTES）
+	// 所属的NUMA节点，释放时还给这个节点的PageCache/CentralCache
+	// 其它节点合并相邻span时会不加锁地读它（不同就不合并，也不再读别的字段），所以是原子的；
+	// 只在同时持有新旧两个节点的_page_mtx时修改(StealSpan)，持有本节点_page_mtx时读到本节点就不会再变
+	std::atomic<unsigned char> _node{ 0 };
+
+	HeapSample* _sample = nullptr;	// 被堆采样的对象单独占一个span，指向采样记录
 };
 
 // 带头双向循环链表
 class SpanList
 {
 private:
+	// 头结点直接内嵌，不用new：全局operator new被替换成内存池后，构造SpanList时不能再回头调用内存池
+	Span _head_node;
 	Span* _head;
 public:
 	std::mutex _mtx;  // 桶锁，减少锁的竞争
@@ -287,11 +635,14 @@ public:
 public:
 	SpanList()
 	{
-		_head = new Span;
+		_head = &_head_node;
 		_head->_next = _head;
 		_head->_prev = _head;
 	}
 
+	SpanList(const SpanList&) = delete;
+	SpanList& operator=(const SpanList&) = delete;
+
 	Span* Begin()
 	{
 		return _head->_next;
@@ -2,8 +2,96 @@
 
 #include "Common.h"
 #include "ThreadCache.h"
+#include "PerCpuCache.h"
 #include "PageCache.h"
 #include "ObjectPool.h"
+#include "HeapProfiler.h"
+
+// 小对象交给前端缓存：启用了per-CPU缓存就先试当前CPU的槽位，没有启用时用线程的ThreadCache
+// 线程退出阶段ThreadCache已经回收，直接与CentralCache交互
+
+// 槽位被占用时的退路：启用了per-CPU缓存就不再为线程创建ThreadCache，否则抢过槽位的线程各自留下一份缓存，
+// 缓存又随线程数增长；已经有的（启用之前创建的）照常使用，没有就直接与CentralCache交互
+static inline ThreadCache* FallbackThreadCache()
+{
+	return PerCpuCache::Enabled() ? Ptr_TLS_ThreadCache : GetThreadCache();
+}
+
+static inline void* FrontAllocate(size_t size)
+{
+	void* ptr = nullptr;
+	if (PerCpuCache::Enabled() && PerCpuCache::GetInstance()->TryAllocate(size, ptr))
+	{
+		return ptr;
+	}
+
+	// 通过TLS每个线程无锁的获取自己的专属的ThreadCache对象
+	ThreadCache* tc = FallbackThreadCache();
+	if (tc != nullptr)
+	{
+		return tc->Allocate(size);
+	}
+
+	return ThreadCache::AllocateNoCache(size);
+}
+
+static inline void FrontDeallocate(void* ptr, size_t size)
+{
+	if (PerCpuCache::Enabled() && PerCpuCache::GetInstance()->TryDeallocate(ptr, size))
+	{
+		return;
+	}
+
+	// 释放的线程不一定申请过内存（跨线程释放），第一次释放时创建ThreadCache
+	ThreadCache* tc = FallbackThreadCache();
+	if (tc != nullptr)
+	{
+		tc->Deallocate(ptr, size);
+		return;
+	}
+
+	ThreadCache::DeallocateNoCache(ptr, size);
+}
+
+static inline void FrontAllocateBatch(size_t size, size_t n, void** batch)
+{
+	if (PerCpuCache::Enabled() && PerCpuCache::GetInstance()->TryAllocateBatch(size, n, batch))
+	{
+		return;
+	}
+
+	ThreadCache* tc = FallbackThreadCache();
+	if (tc != nullptr)
+	{
+		tc->AllocateBatch(size, n, batch);
+		return;
+	}
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		batch[i] = ThreadCache::AllocateNoCache(size);
+	}
+}
+
+static inline void FrontDeallocateBatch(void** batch, size_t n, size_t size)
+{
+	if (PerCpuCache::Enabled() && PerCpuCache::GetInstance()->TryDeallocateBatch(batch, n, size))
+	{
+		return;
+	}
+
+	ThreadCache* tc = FallbackThreadCache();
+	if (tc != nullptr)
+	{
+		tc->DeallocateBatch(batch, n, size);
+		return;
+	}
+
+	for (size_t i = 0; i < n; ++i)
+	{
+		ThreadCache::DeallocateNoCache(batch[i], size);
+	}
+}
 
 static void* ConcurrentAlloc(size_t size)
 {
@@ -11,33 +99,37 @@ static void* ConcurrentAlloc(size_t size)
 	// 1. size > 32page && size < 128 page
 	//    可以向PageCache申请空间
 	// 2. size > 128 page
-	//    这时，直接向系统堆申请空间
-	// 上述的两种情况都在Page Cache的NewSpan函数中处理
-	// 所以，下面代码使用统一的方式去解决
+	//    这时，从大对象缓存中取，没有再直接向系统堆申请空间
+	//    不经过PageCache的空闲链表，也不用拿_page_mtx
 	if (size > MAX_BYTES)
 	{
 		size_t align_size = SizeClass::RoundUp(size);
 		size_t page_num = align_size >> PAGE_SHIFT;
 
-		PageCache::GetInstance()->_page_mtx.lock();
-		Span* span = PageCache::GetInstance()->NewSpan(page_num);
+		// 从当前线程所在节点的PageCache申请
+		PageCache* page_cache = PageCache::GetInstance(Numa::CurrentNode());
+		Span* span = nullptr;
+		if (page_num > NUM_PAGE - 1)
+		{
+			span = page_cache->NewLargeSpan(page_num);
+		}
+		else
+		{
+			page_cache->_page_mtx.lock();
+			span = page_cache->NewSpan(page_num);
+			page_cache->_page_mtx.unlock();
+		}
 		span->_obj_size = size;
-		PageCache::GetInstance()->_page_mtx.unlock();
+		++page_cache->_large_alloc_count;
+
+		HeapProfiler::GetInstance()->MaybeSampleLarge(span, size);
 
 		void* ptr = (void*)(span->_page_id << PAGE_SHIFT);
 		return ptr;
 	}
 	else
 	{
-		// 通过TLS每个线程无锁的获取自己的专属的ThreadCache对象
-		if (nullptr == Ptr_TLS_ThreadCache)
-		{
-			static ObjectPool<ThreadCache> tc_pool;
-			//Ptr_TLS_ThreadCache = new ThreadCache;
-			Ptr_TLS_ThreadCache = tc_pool.New();
-		}
-
-		return Ptr_TLS_ThreadCache->Allocate(size);
+		return FrontAllocate(size);
 	}
 }
 
@@ -46,15 +138,264 @@ static void ConcurrentFree(void* ptr)
 	Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
 	size_t size = span->_obj_size;
 
-	if (size > MAX_BYTES)
+	if (span->_sample != nullptr)
+	{
+		HeapProfiler::GetInstance()->FreeSampled(span);
+	}
+	else if (size > MAX_BYTES || span->_is_aligned)
+	{
+		// 还给span所属节点的PageCache
+		span->_is_aligned = false;
+		PageCache* page_cache = PageCache::GetInstance(span->_node);
+		if (span->_page_num > NUM_PAGE - 1)
+		{
+			page_cache->ReleaseLargeSpan(span);
+		}
+		else
+		{
+			page_cache->_page_mtx.lock();
+			page_cache->ReleaseSpanToPage(span);
+			page_cache->_page_mtx.unlock();
+		}
+		++page_cache->_large_free_count;
+	}
+	else
+	{
+		FrontDeallocate(ptr, size);
+	}
+}
+
+// 调用方知道对象大小时使用：小对象直接交给前端缓存，省掉一次基数树查找和对span的访问
+// size必须是申请时传入的大小（或者与之映射到同一个桶的大小）
+static void ConcurrentFree(void* ptr, size_t size)
+{
+	// 大对象本来就要拿到span还给PageCache
+	// 还有没释放的被采样小对象时，小对象也可能是单独占一个span的采样对象
+	if (size > MAX_BYTES || HeapProfiler::HasSmallSamples())
 	{
-		PageCache::GetInstance()->_page_mtx.lock();
-		PageCache::GetInstance()->ReleaseSpanToPage(span);
-		PageCache::GetInstance()->_page_mtx.unlock();
+		ConcurrentFree(ptr);
 	}
 	else
 	{
-		assert(Ptr_TLS_ThreadCache);
-		Ptr_TLS_ThreadCache->Deallocate(ptr, size);
+		FrontDeallocate(ptr, size);
+	}
+}
+
+// 一次申请n个size大小的对象放到batch中：只查一次桶，整段从自由链表取出，不够时一次向CentralCache要齐
+// 失败时抛出异常，已经拿到的对象全部放回，batch中的内容无意义
+static void ConcurrentAllocBatch(size_t size, size_t n, void** batch)
+{
+	if (n == 0)
+	{
+		return;
+	}
+
+	if (size <= MAX_BYTES)
+	{
+		FrontAllocateBatch(size, n, batch);
+		return;
+	}
+
+	// 大对象每个都要单独的span，逐个申请
+	size_t i = 0;
+	try
+	{
+		for (; i < n; ++i)
+		{
+			batch[i] = ConcurrentAlloc(size);
+		}
+	}
+	catch (...)
+	{
+		while (i > 0)
+		{
+			ConcurrentFree(batch[--i]);
+		}
+		throw;
 	}
 }
+
+// 释放n个同样大小的对象，size的要求与ConcurrentFree(ptr, size)相同
+// 小对象串成一段挂到自由链表上，过长时按整批还给CentralCache
+static void ConcurrentFreeBatch(void** batch, size_t n, size_t size)
+{
+	if (n == 0)
+	{
+		return;
+	}
+
+	if (size > MAX_BYTES || HeapProfiler::HasSmallSamples())
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			ConcurrentFree(batch[i]);
+		}
+		return;
+	}
+
+	FrontDeallocateBatch(batch, n, size);
+}
+
+// 不知道大小时：逐个查span，相邻的同样大小的小对象合成一段一起释放
+static void ConcurrentFreeBatch(void** batch, size_t n)
+{
+	size_t i = 0;
+	while (i < n)
+	{
+		Span* span = PageCache::GetInstance()->MapObjectToSpan(batch[i]);
+		size_t size = span->_obj_size;
+		if (span->_sample != nullptr || size > MAX_BYTES || span->_is_aligned)
+		{
+			ConcurrentFree(batch[i]);
+			++i;
+			continue;
+		}
+
+		size_t j = i + 1;
+		while (j < n)
+		{
+			Span* next = PageCache::GetInstance()->MapObjectToSpan(batch[j]);
+			if (next->_sample != nullptr || next->_is_aligned || next->_obj_size > MAX_BYTES || next->_obj_size != size)
+				break;
+			++j;
+		}
+
+		FrontDeallocateBatch(batch + i, j - i, size);
+		i = j;
+	}
+}
+
+// 申请按align(2的幂)对齐的空间
+// 不超过一页的对齐由对象大小是align整数倍的桶保证，更大的对齐由PageCache切出对齐的span
+// 整页申请的span占max(size按页对齐, align)字节，标记为_is_aligned，释放时按大对象还给PageCache
+// 释放时用ConcurrentFree(ptr)，或者ConcurrentFreeAligned(ptr, size, align)走有尺寸的释放
+static void* ConcurrentAllocAligned(size_t size, size_t align)
+{
+	size_t alloc_size = SizeClass::AlignedSize(size, align);
+	if (alloc_size != 0)
+	{
+		return FrontAllocate(alloc_size);
+	}
+
+	if (size == 0)
+	{
+		size = 1;
+	}
+
+	size_t align_pages = align >> PAGE_SHIFT;
+	if (align_pages == 0)
+	{
+		align_pages = 1;	// 不超过一页的对齐，页本身就满足
+	}
+	size_t page_num = std::max(SizeClass::_RoundUp(size, (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT, align_pages);
+
+	PageCache* page_cache = PageCache::GetInstance(Numa::CurrentNode());
+	Span* span = nullptr;
+	if (page_num > NUM_PAGE - 1)
+	{
+		span = page_cache->NewLargeSpan(page_num, align_pages);
+	}
+	else
+	{
+		page_cache->_page_mtx.lock();
+		span = page_cache->NewAlignedSpan(page_num, align_pages);
+		page_cache->_page_mtx.unlock();
+	}
+	span->_obj_size = size;
+	span->_is_aligned = true;
+	++page_cache->_large_alloc_count;
+
+	HeapProfiler::GetInstance()->MaybeSampleLarge(span, size);
+
+	return (void*)(span->_page_id << PAGE_SHIFT);
+}
+
+static void ConcurrentFreeAligned(void* ptr, size_t size, size_t align)
+{
+	size_t alloc_size = SizeClass::AlignedSize(size, align);
+	if (alloc_size != 0)
+	{
+		ConcurrentFree(ptr, alloc_size);
+	}
+	else
+	{
+		ConcurrentFree(ptr);
+	}
+}
+
+// 调整ptr的大小，尽量不搬移数据：
+//	1. 小对象新的大小仍落在同一个桶，原地返回
+//	2. 大对象调整span的页数：缩小时尾部还给PageCache，扩大时占用后面空闲的span，超过128页用mremap
+//	3. 以上都不行，才重新申请、拷贝、释放
+static void* ConcurrentRealloc(void* ptr, size_t size)
+{
+	if (ptr == nullptr)
+	{
+		return ConcurrentAlloc(size);
+	}
+
+	if (size == 0)
+	{
+		ConcurrentFree(ptr);
+		return nullptr;
+	}
+
+	Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+	size_t old_size = span->_obj_size;
+
+	if (old_size <= MAX_BYTES && !span->_is_aligned)
+	{
+		// 小对象span记录的就是桶对齐后的大小
+		if (size <= MAX_BYTES && SizeClass::RoundUp(size) == old_size)
+		{
+			return ptr;
+		}
+	}
+	else if (size > MAX_BYTES && span->_sample == nullptr)
+	{
+		// 被采样的大对象记录着申请时的大小，不原地调整
+		size_t page_num = SizeClass::RoundUp(size) >> PAGE_SHIFT;
+
+		PageCache* page_cache = PageCache::GetInstance(span->_node);
+		bool in_place = false;
+		if (span->_page_num > NUM_PAGE - 1)
+		{
+			// 单独映射的大span用mremap调整，不需要_page_mtx
+			in_place = page_cache->ResizeLargeSpan(span, page_num);
+		}
+		else
+		{
+			page_cache->_page_mtx.lock();
+			in_place = page_cache->ResizeSpan(span, page_num);
+			page_cache->_page_mtx.unlock();
+		}
+
+		if (in_place)
+		{
+			// 调整之后就是普通的大对象，起始页可能已经变了，不再保证原来的对齐
+			span->_obj_size = size;
+			span->_is_aligned = false;
+			return (void*)(span->_page_id << PAGE_SHIFT);
+		}
+	}
+
+	void* new_ptr = ConcurrentAlloc(size);
+	memcpy(new_ptr, ptr, std::min(old_size, size));
+	ConcurrentFree(ptr);
+
+	return new_ptr;
+}
+
+// ptr实际可用的字节数（不小于申请时的大小）
+static size_t ConcurrentUsableSize(void* ptr)
+{
+	Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+
+	// 小对象span记录的是桶对齐后的大小，大对象（包括整页申请的对齐对象）记录的是申请的大小，可用的是整个span
+	if (span->_obj_size > MAX_BYTES || span->_is_aligned)
+	{
+		return span->_page_num << PAGE_SHIFT;
+	}
+
+	return span->_obj_size;
+}
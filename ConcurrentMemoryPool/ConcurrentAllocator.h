@@ -0,0 +1,91 @@
+﻿#pragma once
+
+#include "ConcurrentAlloc.h"
+
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+// 标准库容器接入内存池
+//	std::map<K, V, std::less<K>, ConcurrentAllocator<std::pair<const K, V>>>
+//	std::pmr::map<K, V> m(ConcurrentMemoryResource::GetInstance());
+// 两者都走有尺寸的释放：容器释放节点时总是带着申请时的个数，小对象不用查基数树
+// alignof(T)超过8字节时按ConcurrentAllocAligned对齐，释放时用同样的对齐换算回原来的桶
+
+// 满足标准Allocator要求，没有状态，所有实例都共用同一个内存池，彼此相等
+template<class T>
+class ConcurrentAllocator
+{
+public:
+	typedef T value_type;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type is_always_equal;
+
+	ConcurrentAllocator() noexcept {}
+
+	template<class U>
+	ConcurrentAllocator(const ConcurrentAllocator<U>&) noexcept {}
+
+	T* allocate(size_t n)
+	{
+		if (n > max_size())
+		{
+			throw std::bad_array_new_length();
+		}
+		return (T*)ConcurrentAllocAligned(n * sizeof(T), alignof(T));
+	}
+
+	void deallocate(T* ptr, size_t n) noexcept
+	{
+		ConcurrentFreeAligned(ptr, n * sizeof(T), alignof(T));
+	}
+
+	size_t max_size() const noexcept
+	{
+		return std::numeric_limits<size_t>::max() / sizeof(T);
+	}
+};
+
+template<class T, class U>
+inline bool operator==(const ConcurrentAllocator<T>&, const ConcurrentAllocator<U>&) noexcept
+{
+	return true;
+}
+
+template<class T, class U>
+inline bool operator!=(const ConcurrentAllocator<T>&, const ConcurrentAllocator<U>&) noexcept
+{
+	return false;
+}
+
+// std::pmr容器使用的memory_resource
+// 没有状态，任意两个实例申请的内存可以互相释放；GetInstance返回的实例不析构，静态对象里的容器也能放心使用
+class ConcurrentMemoryResource : public std::pmr::memory_resource
+{
+public:
+	static ConcurrentMemoryResource* GetInstance()
+	{
+		alignas(ConcurrentMemoryResource) static char storage[sizeof(ConcurrentMemoryResource)];
+		static ConcurrentMemoryResource* instance = new(storage) ConcurrentMemoryResource;
+		return instance;
+	}
+
+private:
+	void* do_allocate(size_t bytes, size_t align) override
+	{
+		return ConcurrentAllocAligned(bytes, align);
+	}
+
+	void do_deallocate(void* ptr, size_t bytes, size_t align) override
+	{
+		ConcurrentFreeAligned(ptr, bytes, align);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return dynamic_cast<const ConcurrentMemoryResource*>(&other) != nullptr;
+	}
+};
@@ -0,0 +1,326 @@
+﻿#include "HeapProfiler.h"
+#include "PageCache.h"
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#if defined(__linux__)
+	#include <execinfo.h>
+	#include <fcntl.h>
+#endif
+
+// 同一个调用栈的所有采样累计在一起
+struct StackBucket
+{
+	StackBucket* _next = nullptr;	// 哈希冲突链
+	size_t _hash = 0;
+	int _depth = 0;
+	void* _stack[HeapProfiler::MAX_DEPTH];
+
+	uint64_t _alloc_count = 0;
+	uint64_t _alloc_bytes = 0;
+	uint64_t _free_count = 0;
+	uint64_t _free_bytes = 0;
+};
+
+std::atomic<size_t> HeapProfiler::_sample_period(0);
+std::atomic<bool> HeapProfiler::_active(false);
+std::atomic<size_t> HeapProfiler::_small_samples(0);
+
+// 最近一次开启时的采样间隔，关闭采样之后导出的profile仍然按它还原
+static std::atomic<size_t> last_sample_period(0);
+
+// 关闭采样时，每申请这么多字节才重新检查一次是否开启
+static const long long DISABLED_INTERVAL = 2 * 1024 * 1024;
+
+// 取调用栈、拼profile字符串时会申请内存（backtrace第一次调用还会加载libgcc_s），
+// 这期间本线程的申请不再被采样，否则会重入采样、在_mtx上死锁
+static thread_local bool tls_in_profiler = false;
+
+// 大对象不经过ThreadCache，用单独的线程局部计数
+static thread_local long long tls_large_until_sample = 0;
+static thread_local uint64_t tls_large_rng = 0;
+
+struct ProfilerGuard
+{
+	bool _old;
+
+	ProfilerGuard()
+		: _old(tls_in_profiler)
+	{
+		tls_in_profiler = true;
+	}
+
+	~ProfilerGuard()
+	{
+		tls_in_profiler = _old;
+	}
+};
+
+static int CaptureStack(void** stack, int max_depth)
+{
+#if defined(__linux__)
+	return backtrace(stack, max_depth);
+#elif defined(_WIN32)
+	return (int)CaptureStackBackTrace(0, (DWORD)max_depth, stack, nullptr);
+#else
+	(void)stack;
+	(void)max_depth;
+	return 0;
+#endif
+}
+
+void HeapProfiler::SetSamplePeriod(size_t bytes)
+{
+	if (bytes > 0 && !_active.load(std::memory_order_relaxed))
+	{
+		// 先取一次调用栈，让backtrace在开启采样之前完成初始化
+		void* stack[4];
+		ProfilerGuard guard;
+		CaptureStack(stack, 4);
+
+		_active.store(true, std::memory_order_relaxed);
+	}
+
+	if (bytes > 0)
+	{
+		last_sample_period.store(bytes, std::memory_order_relaxed);
+	}
+
+	_sample_period.store(bytes, std::memory_order_relaxed);
+}
+
+bool HeapProfiler::InProfiler()
+{
+	return tls_in_profiler;
+}
+
+long long HeapProfiler::NextSampleInterval(uint64_t& rng)
+{
+	size_t period = SamplePeriod();
+	if (period == 0)
+	{
+		return DISABLED_INTERVAL;
+	}
+
+	// xorshift64*，第一次用状态自己的地址做种子，每个ThreadCache各不相同
+	if (rng == 0)
+	{
+		rng = (uint64_t)(uintptr_t)&rng ^ 0x9E3779B97F4A7C15ULL;
+	}
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	uint64_t r = rng * 2685821657736338717ULL;
+
+	// u在(0, 1]之间均匀分布，-ln(u) * period服从均值为period的指数分布
+	double u = (double)((r >> 11) + 1) / 9007199254740992.0;
+	return (long long)(-std::log(u) * (double)period) + 1;
+}
+
+HeapSample* HeapProfiler::Record(size_t size)
+{
+	ProfilerGuard guard;
+
+	// 跳过Record和AllocateSampled/MaybeSampleLarge自己
+	const int skip = 2;
+	void* raw[MAX_DEPTH + skip];
+	int depth = CaptureStack(raw, MAX_DEPTH + skip) - skip;
+	if (depth < 0)
+		depth = 0;
+	void** stack = raw + skip;
+
+	size_t hash = 0;
+	for (int i = 0; i < depth; ++i)
+	{
+		hash = (hash ^ (size_t)(uintptr_t)stack[i]) * 1099511628211ULL;
+	}
+
+	std::unique_lock<std::mutex> lock(_mtx);
+
+	StackBucket*& head = _buckets[hash % NUM_BUCKETS];
+	StackBucket* bucket = head;
+	while (bucket != nullptr)
+	{
+		if (bucket->_hash == hash && bucket->_depth == depth
+			&& memcmp(bucket->_stack, stack, sizeof(void*) * depth) == 0)
+		{
+			break;
+		}
+		bucket = bucket->_next;
+	}
+
+	if (bucket == nullptr)
+	{
+		bucket = _bucket_pool.New();
+		bucket->_hash = hash;
+		bucket->_depth = depth;
+		memcpy(bucket->_stack, stack, sizeof(void*) * depth);
+		bucket->_next = head;
+		head = bucket;
+		++_num_buckets;
+	}
+
+	++bucket->_alloc_count;
+	bucket->_alloc_bytes += size;
+
+	HeapSample* sample = _sample_pool.New();
+	sample->_bucket = bucket;
+	sample->_size = size;
+
+	return sample;
+}
+
+void* HeapProfiler::AllocateSampled(size_t alloc_size, size_t size)
+{
+	size_t page_num = SizeClass::_RoundUp(alloc_size, (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT;
+
+	PageCache* page_cache = PageCache::GetInstance(Numa::CurrentNode());
+	page_cache->_page_mtx.lock();
+	Span* span = page_cache->NewSpan(page_num);
+	span->_obj_size = alloc_size;
+	page_cache->_page_mtx.unlock();
+
+	span->_sample = Record(size);
+	_small_samples.fetch_add(1, std::memory_order_relaxed);
+
+	return (void*)(span->_page_id << PAGE_SHIFT);
+}
+
+void HeapProfiler::MaybeSampleLarge(Span* span, size_t size)
+{
+	tls_large_until_sample -= (long long)size;
+	if (tls_large_until_sample >= 0)
+	{
+		return;
+	}
+
+	tls_large_until_sample = NextSampleInterval(tls_large_rng);
+	if (SamplePeriod() == 0 || InProfiler())
+	{
+		return;
+	}
+
+	span->_sample = Record(size);
+}
+
+void HeapProfiler::FreeSampled(Span* span)
+{
+	HeapSample* sample = span->_sample;
+	span->_sample = nullptr;
+
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		++sample->_bucket->_free_count;
+		sample->_bucket->_free_bytes += sample->_size;
+		_sample_pool.Delete(sample);
+	}
+
+	// 还给PageCache之后span可能被合并或者回收，先取出大小
+	bool large = span->_obj_size > MAX_BYTES || span->_is_aligned;
+	span->_is_aligned = false;
+	if (!large)
+	{
+		_small_samples.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	PageCache* page_cache = PageCache::GetInstance(span->_node);
+	if (span->_page_num > NUM_PAGE - 1)
+	{
+		page_cache->ReleaseLargeSpan(span);
+	}
+	else
+	{
+		page_cache->_page_mtx.lock();
+		page_cache->ReleaseSpanToPage(span);
+		page_cache->_page_mtx.unlock();
+	}
+
+	if (large)
+	{
+		++page_cache->_large_free_count;
+	}
+}
+
+std::string HeapProfiler::Profile()
+{
+	ProfilerGuard guard;
+
+	// 持有_mtx时不能申请内存：per-CPU前端下，同一个CPU上正在采样的线程拿着槽位锁等_mtx，
+	// 这里再申请就会等那个槽位锁。先在锁外按桶数预留好空间，锁内只做拷贝
+	std::vector<StackBucket> snapshot;
+	while (true)
+	{
+		size_t n = 0;
+		{
+			std::unique_lock<std::mutex> lock(_mtx);
+			n = _num_buckets;
+		}
+		snapshot.reserve(n + 16);
+
+		std::unique_lock<std::mutex> lock(_mtx);
+		if (_num_buckets > snapshot.capacity())
+			continue;
+
+		for (size_t i = 0; i < NUM_BUCKETS; ++i)
+		{
+			for (StackBucket* bucket = _buckets[i]; bucket != nullptr; bucket = bucket->_next)
+			{
+				snapshot.push_back(*bucket);
+			}
+		}
+		break;
+	}
+
+	std::string body;
+	char buf[128];
+	uint64_t total[4] = { 0 };
+
+	for (const StackBucket& bucket : snapshot)
+	{
+		uint64_t inuse_count = bucket._alloc_count - bucket._free_count;
+		uint64_t inuse_bytes = bucket._alloc_bytes - bucket._free_bytes;
+		total[0] += inuse_count;
+		total[1] += inuse_bytes;
+		total[2] += bucket._alloc_count;
+		total[3] += bucket._alloc_bytes;
+
+		snprintf(buf, sizeof(buf), "%6llu: %8llu [%6llu: %8llu] @",
+			(unsigned long long)inuse_count, (unsigned long long)inuse_bytes,
+			(unsigned long long)bucket._alloc_count, (unsigned long long)bucket._alloc_bytes);
+		body += buf;
+		for (int j = 0; j < bucket._depth; ++j)
+		{
+			snprintf(buf, sizeof(buf), " 0x%llx", (unsigned long long)(uintptr_t)bucket._stack[j]);
+			body += buf;
+		}
+		body += "\n";
+	}
+
+	snprintf(buf, sizeof(buf), "heap profile: %6llu: %8llu [%6llu: %8llu] @ heap_v2/%zu\n",
+		(unsigned long long)total[0], (unsigned long long)total[1],
+		(unsigned long long)total[2], (unsigned long long)total[3],
+		last_sample_period.load(std::memory_order_relaxed));
+
+	std::string out = buf;
+	out += body;
+
+#if defined(__linux__)
+	// pprof根据加载的模块把地址还原成符号
+	out += "\nMAPPED_LIBRARIES:\n";
+	int fd = open("/proc/self/maps", O_RDONLY);
+	if (fd >= 0)
+	{
+		char maps[4096];
+		ssize_t n = 0;
+		while ((n = read(fd, maps, sizeof(maps))) > 0)
+		{
+			out.append(maps, (size_t)n);
+		}
+		close(fd);
+	}
+#endif
+
+	return out;
+}
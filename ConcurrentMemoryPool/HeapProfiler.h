@@ -0,0 +1,103 @@
+﻿#pragma once
+
+#include "Common.h"
+#include "ObjectPool.h"
+
+#include <string>
+
+// 堆采样分析
+// 平均每申请_sample_period字节采样一个对象，间隔服从几何分布（指数分布取整），
+// 大对象和小对象被采到的概率都与大小成正比，pprof按heap_v2的公式还原出真实的数量
+//
+// 被采样的小对象不从size class中分配，而是单独占一个span，span->_sample指向采样记录，
+// 释放时查到span就知道它被采样过，不需要额外的哈希表
+struct StackBucket;
+
+struct HeapSample
+{
+	StackBucket* _bucket = nullptr;
+	size_t _size = 0;		// 申请的字节数
+};
+
+class HeapProfiler
+{
+public:
+	static const int MAX_DEPTH = 32;
+
+private:
+	static const size_t NUM_BUCKETS = 4096;	// 调用栈哈希表的桶数
+
+	StackBucket* _buckets[NUM_BUCKETS] = { nullptr };
+	size_t _num_buckets = 0;
+	ObjectPool<StackBucket> _bucket_pool;
+	ObjectPool<HeapSample> _sample_pool;
+	std::mutex _mtx;
+
+	static std::atomic<size_t> _sample_period;
+	static std::atomic<bool> _active;				// 开启过采样（backtrace已经初始化）
+	static std::atomic<size_t> _small_samples;		// 还没有释放的被采样的小对象个数
+
+private:
+	HeapProfiler() {}
+	HeapProfiler(const HeapProfiler&) = delete;
+	HeapProfiler& operator=(const HeapProfiler&) = delete;
+
+	// 记录一次采样，返回挂到span上的记录
+	HeapSample* Record(size_t size);
+
+public:
+	static HeapProfiler* GetInstance()
+	{
+		alignas(HeapProfiler) static char storage[sizeof(HeapProfiler)];
+		static HeapProfiler* instance = new(storage) HeapProfiler;
+		return instance;
+	}
+
+	// 平均采样间隔（字节），0表示关闭
+	static size_t SamplePeriod()
+	{
+		return _sample_period.load(std::memory_order_relaxed);
+	}
+	static void SetSamplePeriod(size_t bytes);
+
+	// 是否还有没释放的被采样的小对象：有的话，有尺寸的释放也要查span，否则会把被采样的对象放进自由链表
+	// 计数归零之后有尺寸的释放又回到不查基数树的快路径；采样一直开着时，快路径上多一次对共享计数的读
+	// 对象从申请它的线程交给释放它的线程总有同步，释放时一定能读到包含这次采样的计数，relaxed就够了
+	static bool HasSmallSamples()
+	{
+		return _small_samples.load(std::memory_order_relaxed) != 0;
+	}
+
+	// 距离下一次采样还要申请的字节数，rng是调用方（ThreadCache）自己的随机数状态
+	// 关闭采样时返回一个较大的间隔，之后再重新检查是否开启了采样
+	static long long NextSampleInterval(uint64_t& rng);
+
+	// 当前线程正在采样/导出profile时，其中的内存申请不再被采样
+	static bool InProfiler();
+
+	// 申请一个被采样的小对象：单独占一个span
+	void* AllocateSampled(size_t alloc_size, size_t size);
+
+	// 大对象的采样判断放在申请之后，被选中时给span挂上采样记录
+	void MaybeSampleLarge(Span* span, size_t size);
+
+	// 释放一个被采样的对象（span->_sample != nullptr），连同span一起还给PageCache
+	void FreeSampled(Span* span);
+
+	// 导出gperftools heap profile格式（pprof可以直接读取）
+	// 每个调用栈一行：正在使用的对象数和字节数，以及[累计申请的对象数和字节数]
+	// pprof -sample_index=inuse_space 看当前的堆，-sample_index=alloc_space 看累计的申请
+	std::string Profile();
+};
+
+// 设置平均采样间隔（字节），0关闭采样
+inline void ConcurrentSetHeapSamplePeriod(size_t bytes)
+{
+	HeapProfiler::SetSamplePeriod(bytes);
+}
+
+// 导出采样到的堆profile
+inline std::string ConcurrentHeapProfile()
+{
+	return HeapProfiler::GetInstance()->Profile();
+}
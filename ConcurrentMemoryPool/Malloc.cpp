@@ -0,0 +1,159 @@
+﻿#include "ConcurrentAlloc.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <malloc.h>
+
+// 用内存池实现C标准库的malloc系列函数，编译成动态库(libConcurrentMalloc.so)
+// 不用修改程序，LD_PRELOAD=libConcurrentMalloc.so 即可让整个进程使用内存池
+//
+// 初始化安全：
+//	1. 内存池的单例在第一次使用时才构造，main之前(甚至libc初始化期间)的malloc也能正常工作
+//	2. 不依赖dlsym找原来的malloc，所有内存都来自内存池，free不需要区分来源
+//	3. 线程登记退出回收时libc会调用calloc，ThreadCache::Create已经保证这种重入是安全的
+//	4. 动态库用initial-exec的TLS模型，访问thread_local不会走__tls_get_addr(可能再调用malloc)
+
+// malloc返回的地址要满足max_align_t对齐，换算规则与operator new相同
+static const size_t MALLOC_ALIGN = alignof(max_align_t);
+static_assert(MALLOC_ALIGN <= 16, "size classes above 128 bytes are only 16-byte aligned");
+
+static inline size_t MallocSize(size_t size)
+{
+	return size < MALLOC_ALIGN ? size : SizeClass::_RoundUp(size, MALLOC_ALIGN);
+}
+
+static inline void* MallocImpl(size_t size) noexcept
+{
+	try
+	{
+		return ConcurrentAlloc(MallocSize(size));
+	}
+	catch (...)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+static inline void* MemalignImpl(size_t align, size_t size) noexcept
+{
+	if (align <= MALLOC_ALIGN)
+		return MallocImpl(size);
+
+	try
+	{
+		return ConcurrentAllocAligned(size, align);
+	}
+	catch (...)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+static inline bool IsPowerOfTwo(size_t n)
+{
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+extern "C"
+{
+
+void* malloc(size_t size) noexcept
+{
+	return MallocImpl(size);
+}
+
+void free(void* ptr) noexcept
+{
+	if (ptr != nullptr)
+		ConcurrentFree(ptr);
+}
+
+void* calloc(size_t n, size_t size) noexcept
+{
+	size_t bytes = n * size;
+	if (size != 0 && bytes / size != n)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	void* ptr = MallocImpl(bytes);
+	if (ptr != nullptr)
+		memset(ptr, 0, bytes);
+
+	return ptr;
+}
+
+void* realloc(void* ptr, size_t size) noexcept
+{
+	if (ptr == nullptr)
+		return MallocImpl(size);
+
+	try
+	{
+		return ConcurrentRealloc(ptr, size == 0 ? 0 : MallocSize(size));
+	}
+	catch (...)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+}
+
+int posix_memalign(void** memptr, size_t align, size_t size) noexcept
+{
+	if (!IsPowerOfTwo(align) || align % sizeof(void*) != 0)
+		return EINVAL;
+
+	void* ptr = MemalignImpl(align, size);
+	if (ptr == nullptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size) noexcept
+{
+	if (!IsPowerOfTwo(align))
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+
+	return MemalignImpl(align, size);
+}
+
+void* memalign(size_t align, size_t size) noexcept
+{
+	if (!IsPowerOfTwo(align))
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+
+	return MemalignImpl(align, size);
+}
+
+void* valloc(size_t size) noexcept
+{
+	return MemalignImpl((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) noexcept
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	return MemalignImpl(page, SizeClass::_RoundUp(size == 0 ? 1 : size, page));
+}
+
+size_t malloc_usable_size(void* ptr) noexcept
+{
+	if (ptr == nullptr)
+		return 0;
+
+	return ConcurrentUsableSize(ptr);
+}
+
+}
@@ -0,0 +1,152 @@
+﻿#include "MallocStats.h"
+#include "ThreadCache.h"
+#include "CentralCache.h"
+#include "PageCache.h"
+
+#include <cstdio>
+#include <cstdarg>
+#include <algorithm>
+
+void ConcurrentGetStats(MallocStats& stats)
+{
+	stats = MallocStats();
+	for (size_t i = 0; i < NUM_FREELIST; ++i)
+	{
+		stats._classes[i]._size = SizeClass::ClassSize(i);
+	}
+
+	// 每个NUMA节点的CentralCache和PageCache累加在一起
+	ThreadCache::CollectStats(stats);
+	for (size_t node = 0; node < Numa::NumNodes(); ++node)
+	{
+		CentralCache::GetInstance(node)->CollectStats(stats);
+		PageCache::GetInstance(node)->CollectStats(stats);
+	}
+
+	// 不在空闲链表和大对象缓存里的页，要么是CentralCache的span，要么是大对象
+	size_t free_bytes = stats._page_cache_bytes + stats._released_bytes + stats._large_cache_bytes;
+	size_t in_use_bytes = stats._mapped_bytes > free_bytes ? stats._mapped_bytes - free_bytes : 0;
+	stats._large_in_use_bytes = in_use_bytes > stats._central_span_bytes ? in_use_bytes - stats._central_span_bytes : 0;
+
+	double fragmentation = 0;
+	for (size_t i = 0; i < NUM_FREELIST; ++i)
+	{
+		const SizeClassStats& cls = stats._classes[i];
+		stats._small_in_use_bytes += cls._live_objects * cls._size;
+		stats._thread_cache_bytes += cls._thread_cache_objects * cls._size;
+		stats._transfer_cache_bytes += cls._transfer_cache_objects * cls._size;
+		stats._central_cache_bytes += cls._central_cache_objects * cls._size;
+
+		fragmentation += (double)cls._span_waste_bytes;
+		if (cls._alloc_count > 0)
+		{
+			double waste = 1.0 - (double)cls._requested_bytes / ((double)cls._alloc_count * cls._size);
+			fragmentation += waste * cls._live_objects * cls._size;
+		}
+	}
+	stats._internal_fragmentation_bytes = (size_t)fragmentation;
+}
+
+// 往out后面追加格式化的内容
+static void Append(std::string& out, const char* fmt, ...)
+#if defined(__GNUC__)
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+
+static void Append(std::string& out, const char* fmt, ...)
+{
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (n > 0)
+	{
+		out.append(buf, std::min((size_t)n, sizeof(buf) - 1));
+	}
+}
+
+static bool ClassUsed(const SizeClassStats& cls)
+{
+	return cls._alloc_count > 0 || cls._span_count > 0 || cls._transfer_cache_objects > 0;
+}
+
+std::string ConcurrentStatsText(const MallocStats& stats)
+{
+	std::string out;
+	const double MB = 1024.0 * 1024.0;
+
+	Append(out, "------------------------------------------------\n");
+	Append(out, "MALLOC: %12zu (%8.1f MiB) Bytes mapped from system\n", stats._mapped_bytes, stats._mapped_bytes / MB);
+	Append(out, "MALLOC: %12zu (%8.1f MiB) Bytes in use by small objects\n", stats._small_in_use_bytes, stats._small_in_use_bytes / MB);
+	Append(out, "MALLOC: %12zu (%8.1f MiB) Bytes in use by large objects\n", stats._large_in_use_bytes, stats._large_in_use_bytes / MB);
+	Append(out, "MALLOC: %12zu (%8.1f MiB) Bytes in thread caches\n", stats._thread_cache_bytes, stats._thread_cache_bytes / MB);
+	Append(out, "MALLOC: %12zu (%8.1f MiB) Thread cache budget\n", stats._thread_cache_budget_bytes, stats._thread_cache_budget_bytes / MB);
+	Append(out, "MALLOC: %12zu Thread caches in use\n", stats._thread_cache_count);
+	Append(out, "MALLOC: %12zu (%8.1f MiB) Bytes in transfer caches\n", stats._transfer_cache_bytes, stats._transfer_cache_bytes / MB);
+	Append(out, "MALLOC: %12zu (%8.1f MiB) Bytes free in central cache spans\n", stats._central_cache_bytes, stats._central_cache_bytes / MB);
+	Append(out, "MALLOC: %12zu (%8.1f MiB) Bytes free in page cache\n", stats._page_cache_bytes, stats._page_cache_bytes / MB);
+	Append(out, "MALLOC: %12zu (%8.1f MiB) Bytes free in large object cache\n", stats._large_cache_bytes, stats._large_cache_bytes / MB);
+	Append(out, "MALLOC: %12zu (%8.1f MiB) Bytes released to system\n", stats._released_bytes, stats._released_bytes / MB);
+	Append(out, "MALLOC: %12zu (%8.1f MiB) Internal fragmentation (estimated)\n", stats._internal_fragmentation_bytes, stats._internal_fragmentation_bytes / MB);
+	Append(out, "MALLOC: %12llu Large allocations, %llu large frees\n",
+		(unsigned long long)stats._large_alloc_count, (unsigned long long)stats._large_free_count);
+	Append(out, "------------------------------------------------\n");
+	Append(out, "%5s %8s %12s %12s %10s %7s %10s %10s %10s\n",
+		"class", "size", "allocs", "frees", "live", "spans", "thread", "transfer", "central");
+
+	for (size_t i = 0; i < NUM_FREELIST; ++i)
+	{
+		const SizeClassStats& cls = stats._classes[i];
+		if (!ClassUsed(cls))
+			continue;
+
+		Append(out, "%5zu %8zu %12llu %12llu %10zu %7zu %10zu %10zu %10zu\n",
+			i, cls._size, (unsigned long long)cls._alloc_count, (unsigned long long)cls._free_count,
+			cls._live_objects, cls._span_count,
+			cls._thread_cache_objects, cls._transfer_cache_objects, cls._central_cache_objects);
+	}
+
+	return out;
+}
+
+std::string ConcurrentStatsJson(const MallocStats& stats)
+{
+	std::string out;
+
+	Append(out, "{\"mapped_bytes\":%zu,\"small_in_use_bytes\":%zu,\"large_in_use_bytes\":%zu,",
+		stats._mapped_bytes, stats._small_in_use_bytes, stats._large_in_use_bytes);
+	Append(out, "\"thread_cache_bytes\":%zu,\"thread_cache_budget_bytes\":%zu,\"thread_cache_count\":%zu,\"transfer_cache_bytes\":%zu,\"central_cache_bytes\":%zu,",
+		stats._thread_cache_bytes, stats._thread_cache_budget_bytes, stats._thread_cache_count, stats._transfer_cache_bytes, stats._central_cache_bytes);
+	Append(out, "\"central_span_bytes\":%zu,\"page_cache_bytes\":%zu,\"large_cache_bytes\":%zu,\"released_bytes\":%zu,",
+		stats._central_span_bytes, stats._page_cache_bytes, stats._large_cache_bytes, stats._released_bytes);
+	Append(out, "\"internal_fragmentation_bytes\":%zu,\"large_alloc_count\":%llu,\"large_free_count\":%llu,",
+		stats._internal_fragmentation_bytes,
+		(unsigned long long)stats._large_alloc_count, (unsigned long long)stats._large_free_count);
+
+	out += "\"size_classes\":[";
+	bool first = true;
+	for (size_t i = 0; i < NUM_FREELIST; ++i)
+	{
+		const SizeClassStats& cls = stats._classes[i];
+		if (!ClassUsed(cls))
+			continue;
+
+		if (!first)
+			out += ",";
+		first = false;
+
+		Append(out, "{\"class\":%zu,\"size\":%zu,\"alloc_count\":%llu,\"free_count\":%llu,\"requested_bytes\":%llu,",
+			i, cls._size, (unsigned long long)cls._alloc_count, (unsigned long long)cls._free_count,
+			(unsigned long long)cls._requested_bytes);
+		Append(out, "\"live_objects\":%zu,\"span_count\":%zu,\"thread_cache_objects\":%zu,",
+			cls._live_objects, cls._span_count, cls._thread_cache_objects);
+		Append(out, "\"transfer_cache_objects\":%zu,\"central_cache_objects\":%zu,\"span_waste_bytes\":%zu}",
+			cls._transfer_cache_objects, cls._central_cache_objects, cls._span_waste_bytes);
+	}
+	out += "]}";
+
+	return out;
+}
@@ -0,0 +1,58 @@
+﻿#pragma once
+
+#include "Common.h"
+
+#include <string>
+
+// 一个size class的统计
+struct SizeClassStats
+{
+	size_t _size = 0;					// 对齐后的对象大小
+	uint64_t _alloc_count = 0;			// 累计申请次数
+	uint64_t _free_count = 0;			// 累计释放次数
+	uint64_t _requested_bytes = 0;		// 累计申请的字节数（对齐前）
+	size_t _live_objects = 0;			// 正在使用的对象个数
+	size_t _span_count = 0;				// CentralCache中这个桶的span个数
+	size_t _thread_cache_objects = 0;	// 缓存在ThreadCache(per-CPU缓存)中的对象个数
+	size_t _transfer_cache_objects = 0;	// 缓存在TransferCache中的对象个数
+	size_t _central_cache_objects = 0;	// CentralCache的span中空闲的对象个数
+	size_t _span_waste_bytes = 0;		// span尾部切不出一个对象的字节数
+};
+
+// 内存池整体的统计，类似tcmalloc的MallocExtension
+// 各层的数据不是在同一时刻采到的，并发申请/释放时彼此之间会有少量出入
+struct MallocStats
+{
+	SizeClassStats _classes[NUM_FREELIST];
+
+	// 小对象
+	size_t _small_in_use_bytes = 0;		// 正在使用的小对象（按对齐后大小）
+	size_t _thread_cache_bytes = 0;
+	size_t _thread_cache_budget_bytes = 0;	// 所有ThreadCache的总预算
+	size_t _thread_cache_count = 0;		// 存在的ThreadCache个数（包括per-CPU缓存的槽位）
+	size_t _transfer_cache_bytes = 0;
+	size_t _central_cache_bytes = 0;	// CentralCache的span中空闲对象的字节数
+	size_t _central_span_bytes = 0;		// CentralCache持有的span总字节数
+
+	// 大对象(> MAX_BYTES)
+	uint64_t _large_alloc_count = 0;
+	uint64_t _large_free_count = 0;
+	size_t _large_in_use_bytes = 0;		// 大对象占用的页（包括超过128页直接向系统申请的）
+	size_t _large_cache_bytes = 0;		// 超过128页的span释放后留在大对象缓存里的字节数
+
+	// PageCache
+	size_t _page_cache_bytes = 0;		// 空闲span中仍然驻留的字节数
+	size_t _released_bytes = 0;			// 空闲span中已经归还给系统的字节数
+	size_t _mapped_bytes = 0;			// PageCache向系统申请的总字节数（不含元数据）
+
+	// 内部碎片的估计：对齐浪费的部分 + span尾部的浪费
+	// 对齐浪费按每个桶累计申请的平均浪费比例折算到正在使用的对象上
+	size_t _internal_fragmentation_bytes = 0;
+};
+
+// 采集当前的统计数据
+void ConcurrentGetStats(MallocStats& stats);
+
+// 把统计数据格式化为可读的文本/JSON，只输出用到过的size class
+std::string ConcurrentStatsText(const MallocStats& stats);
+std::string ConcurrentStatsJson(const MallocStats& stats);
@@ -0,0 +1,151 @@
+﻿#pragma once
+
+#include "Common.h"
+
+#include <chrono>
+#include <cstdio>
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+#endif
+
+// 各层内部路径的微基准共用的计时框架
+// 每个用例跑若干次，取每次操作耗时最小的一次（排除调度、缺页等干扰），输出ns/op和cycles/op
+// cycles用TSC计数，非x86平台没有时输出n/a
+//
+// 读一次steady_clock和TSC本身要几十ns，和被测的操作是一个量级：
+// 用例尽量把整个循环夹在一次Start/Stop之间再除以次数；只能逐次计时的，
+// 每次Start/Stop的固定开销先用空的Start/Stop校准出来，从结果里扣掉，开销本身在第一行输出
+
+static inline uint64_t MicroNowNs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t MicroCycles()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// 阻止编译器把被测的结果优化掉
+static inline void DoNotOptimize(void* p)
+{
+#if defined(_MSC_VER)
+	(void)p;
+	_ReadWriteBarrier();
+#else
+	asm volatile("" : : "g"(p) : "memory");
+#endif
+}
+
+// 用例里只把被测的部分夹在Start/Stop之间，准备和清理工作不计入
+class MicroTimer
+{
+private:
+	uint64_t _ns = 0;
+	uint64_t _cycles = 0;
+	uint64_t _laps = 0;		// Start/Stop的次数，每次都要扣掉一份计时开销
+	uint64_t _ns_begin = 0;
+	uint64_t _cycles_begin = 0;
+
+public:
+	void Start()
+	{
+		_ns_begin = MicroNowNs();
+		_cycles_begin = MicroCycles();
+	}
+
+	void Stop()
+	{
+		_cycles += MicroCycles() - _cycles_begin;
+		_ns += MicroNowNs() - _ns_begin;
+		++_laps;
+	}
+
+	uint64_t Ns() const { return _ns; }
+	uint64_t Cycles() const { return _cycles; }
+	uint64_t Laps() const { return _laps; }
+};
+
+// 一次空的Start/Stop计进去的时间
+struct MicroOverhead
+{
+	double _ns = 0;
+	double _cycles = 0;
+};
+
+// 第一次调用时校准（多跑几轮取最小值），并输出一次
+static const MicroOverhead& MicroTimerOverhead()
+{
+	static const MicroOverhead overhead = []() {
+		const size_t kLaps = 1 << 16;
+		const int kTrials = 7;
+
+		MicroOverhead best;
+		for (int i = 0; i < kTrials; ++i)
+		{
+			MicroTimer timer;
+			for (size_t j = 0; j < kLaps; ++j)
+			{
+				timer.Start();
+				timer.Stop();
+			}
+
+			double ns = (double)timer.Ns() / kLaps;
+			if (i == 0 || ns < best._ns)
+			{
+				best._ns = ns;
+				best._cycles = (double)timer.Cycles() / kLaps;
+			}
+		}
+
+		printf("%-48s %10.2f ns/lap %8.1f cycles/lap (subtracted per Start/Stop)\n",
+			"MicroTimer overhead", best._ns, best._cycles);
+		return best;
+	}();
+
+	return overhead;
+}
+
+// fn(MicroTimer&)执行ops次被测操作
+template<class Fn>
+static void RunMicroBench(const char* name, size_t ops, Fn fn)
+{
+	const int kTrials = 7;
+	const MicroOverhead& overhead = MicroTimerOverhead();
+
+	// 预热一次：建好基数树节点、填满缓存
+	{
+		MicroTimer warmup;
+		fn(warmup);
+	}
+
+	double best_ns = 0;
+	double best_cycles = 0;
+	for (int i = 0; i < kTrials; ++i)
+	{
+		MicroTimer timer;
+		fn(timer);
+
+		double ns = std::max((double)timer.Ns() - overhead._ns * timer.Laps(), 0.0) / ops;
+		double cycles = std::max((double)timer.Cycles() - overhead._cycles * timer.Laps(), 0.0) / ops;
+		if (i == 0 || ns < best_ns)
+		{
+			best_ns = ns;
+			best_cycles = cycles;
+		}
+	}
+
+	if (MicroCycles() != 0)
+		printf("%-48s %10.2f ns/op %10.1f cycles/op\n", name, best_ns, best_cycles);
+	else
+		printf("%-48s %10.2f ns/op %10s cycles/op\n", name, best_ns, "n/a");
+	fflush(stdout);
+}
@@ -0,0 +1,60 @@
+﻿#include "MicroBench.h"
+#include "CentralCache.h"
+
+#include <vector>
+
+// CentralCache：从span中取一批、把一批还给span，以及中转缓存命中
+int main()
+{
+	const size_t kSize = 64;
+	const size_t kIndex = SizeClass::Index(kSize);
+	const size_t kBatch = SizeClass::Info(kIndex)._batch;
+	const size_t kSmallBatch = 32;		// 小于kBatch，不走中转缓存
+	const size_t kOps = 4096;
+
+	CentralCache* cc = CentralCache::GetInstance();
+	std::vector<void*> lists(kOps);
+	std::vector<void*> ends(kOps);
+
+	RunMicroBench("CentralCache FetchRangeObj span path (32 objs)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+			cc->FetchRangeObj(lists[i], ends[i], kSmallBatch, kSize);
+		timer.Stop();
+
+		for (size_t i = 0; i < kOps; ++i)
+			cc->ReleaseListToSpans(lists[i], kSize);
+	});
+
+	RunMicroBench("CentralCache ReleaseListToSpans (32 objs)", kOps, [&](MicroTimer& timer) {
+		for (size_t i = 0; i < kOps; ++i)
+			cc->FetchRangeObj(lists[i], ends[i], kSmallBatch, kSize);
+
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+			cc->ReleaseListToSpans(lists[i], kSize);
+		timer.Stop();
+	});
+
+	// 一整批还回中转缓存，再整批取走
+	void* start = nullptr;
+	void* end = nullptr;
+	cc->FetchRangeObj(start, end, kBatch, kSize);
+	size_t n = 1;
+	for (void* p = start; p != end; p = NextObj(p))
+		++n;
+
+	const size_t kTransferOps = 1 << 18;
+	RunMicroBench("CentralCache transfer cache Release+Fetch (pair)", kTransferOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kTransferOps; ++i)
+		{
+			cc->ReleaseRangeObj(start, end, n, kSize);
+			n = cc->FetchRangeObj(start, end, kBatch, kSize);
+		}
+		timer.Stop();
+	});
+
+	cc->ReleaseListToSpans(start, kSize);
+	return 0;
+}
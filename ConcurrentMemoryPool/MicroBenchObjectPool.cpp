@@ -0,0 +1,110 @@
+﻿#include "MicroBench.h"
+#include "ObjectPool.h"
+
+#include <vector>
+
+// 定长对象池，与new/delete对比
+int main()
+{
+	const size_t kOps = 1 << 16;
+	std::vector<Span*> objs(kOps);
+
+	ObjectPool<Span> pool;
+	RunMicroBench("ObjectPool<Span>::New (free list)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+			objs[i] = pool.New();
+		timer.Stop();
+
+		for (size_t i = 0; i < kOps; ++i)
+			pool.Delete(objs[i]);
+	});
+
+	RunMicroBench("ObjectPool<Span>::Delete", kOps, [&](MicroTimer& timer) {
+		for (size_t i = 0; i < kOps; ++i)
+			objs[i] = pool.New();
+
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+			pool.Delete(objs[i]);
+		timer.Stop();
+	});
+
+	// 每次都用一个新的池，对象全部从新申请的大块内存中切出来
+	RunMicroBench("ObjectPool<Span>::New (carve from chunk)", kOps, [&](MicroTimer& timer) {
+		ObjectPool<Span>* fresh = new ObjectPool<Span>;
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+			objs[i] = fresh->New();
+		timer.Stop();
+		// 池本身不归还大块内存，这里只丢掉池对象
+		delete fresh;
+	});
+
+	RunMicroBench("new Span / delete (pair)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+		{
+			Span* s = new Span;
+			DoNotOptimize(s);
+			delete s;
+		}
+		timer.Stop();
+	});
+
+	RunMicroBench("ObjectPool<Span> New/Delete (pair)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+		{
+			Span* s = pool.New();
+			DoNotOptimize(s);
+			pool.Delete(s);
+		}
+		timer.Stop();
+	});
+
+	// 批量接口：空闲链表整条拿走/整条挂回，新空间连续切
+	RunMicroBench("ObjectPool<Span>::NewN/DeleteN (free list)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		pool.NewN(objs.data(), kOps);
+		pool.DeleteN(objs.data(), kOps);
+		timer.Stop();
+	});
+
+	RunMicroBench("ObjectPool<Span>::NewN (carve from chunk)", kOps, [&](MicroTimer& timer) {
+		ObjectPool<Span>* fresh = new ObjectPool<Span>;
+		timer.Start();
+		fresh->NewN(objs.data(), kOps);
+		timer.Stop();
+		delete fresh;
+	});
+
+	// 多线程共用的池，对象进出本线程的magazine
+	// 主线程的magazine在main返回之后才还给池，池要比它活得更久
+	static ConcurrentObjectPool<Span> concurrent_pool;
+	RunMicroBench("ConcurrentObjectPool<Span> New/Delete (pair)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+		{
+			Span* s = concurrent_pool.New();
+			DoNotOptimize(s);
+			concurrent_pool.Delete(s);
+		}
+		timer.Stop();
+	});
+
+	// 一次拿满再一次放回，每个magazine都要和depot交换
+	RunMicroBench("ConcurrentObjectPool<Span> New/Delete (batch of 4096)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; i += 4096)
+		{
+			for (size_t j = 0; j < 4096; ++j)
+				objs[j] = concurrent_pool.New();
+			for (size_t j = 0; j < 4096; ++j)
+				concurrent_pool.Delete(objs[j]);
+		}
+		timer.Stop();
+	});
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+﻿#include "MicroBench.h"
+#include "PageCache.h"
+
+#include <vector>
+
+// PageCache：从128页的span中切出k页，以及释放时与前后的空闲span合并
+int main()
+{
+	PageCache* pc = PageCache::GetInstance();
+	const size_t kOps = 1 << 16;
+
+	// 每一轮从一个128页的span切满，再全部还回去合并成128页，计时的是连续的一段切分/合并
+	const size_t kPages[] = { 1, 8, 32 };
+	std::vector<Span*> round(NUM_PAGE - 1);
+	for (size_t k : kPages)
+	{
+		const size_t per_round = (NUM_PAGE - 1) / k;
+		const size_t ops = kOps / per_round * per_round;
+
+		char name[64];
+		snprintf(name, sizeof(name), "PageCache NewSpan split (%zu pages)", k);
+		RunMicroBench(name, ops, [&](MicroTimer& timer) {
+			std::unique_lock<std::mutex> lock(pc->_page_mtx);
+			for (size_t i = 0; i < ops; i += per_round)
+			{
+				timer.Start();
+				for (size_t j = 0; j < per_round; ++j)
+					round[j] = pc->NewSpan(k);
+				timer.Stop();
+
+				for (size_t j = 0; j < per_round; ++j)
+					pc->ReleaseSpanToPage(round[j]);
+			}
+		});
+
+		snprintf(name, sizeof(name), "PageCache ReleaseSpanToPage coalesce (%zu pages)", k);
+		RunMicroBench(name, ops, [&](MicroTimer& timer) {
+			std::unique_lock<std::mutex> lock(pc->_page_mtx);
+			for (size_t i = 0; i < ops; i += per_round)
+			{
+				for (size_t j = 0; j < per_round; ++j)
+					round[j] = pc->NewSpan(k);
+
+				timer.Start();
+				for (size_t j = 0; j < per_round; ++j)
+					pc->ReleaseSpanToPage(round[j]);
+				timer.Stop();
+			}
+		});
+	}
+
+	// 一次性切出很多span再逐个释放：释放时前后都可能有空闲span，合并的路径更长
+	const size_t kSpans = 4096;
+	std::vector<Span*> spans(kSpans);
+	RunMicroBench("PageCache ReleaseSpanToPage (fragmented, 1 page)", kSpans, [&](MicroTimer& timer) {
+		std::unique_lock<std::mutex> lock(pc->_page_mtx);
+		for (auto& span : spans)
+			span = pc->NewSpan(1);
+
+		timer.Start();
+		for (size_t i = 0; i < kSpans; i += 2)
+			pc->ReleaseSpanToPage(spans[i]);
+		for (size_t i = 1; i < kSpans; i += 2)
+			pc->ReleaseSpanToPage(spans[i]);
+		timer.Stop();
+	});
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+﻿#include "MicroBench.h"
+#include "PageCache.h"
+#include "ConcurrentAlloc.h"
+
+#include <vector>
+
+// 页号到span的基数树查找
+int main()
+{
+	const size_t kPages = 1 << 20;			// 8GB的地址范围
+	const size_t kOps = 1 << 22;
+
+#if defined(_WIN64) || UINTPTR_MAX > 0xFFFFFFFFu
+	typedef TCMalloc_PageMap3<48 - PAGE_SHIFT> Map;
+	const PAGE_ID kBase = (PAGE_ID)0x7f0000000000ULL >> PAGE_SHIFT;
+#else
+	typedef TCMalloc_PageMap1<32 - PAGE_SHIFT> Map;
+	const PAGE_ID kBase = 0;
+#endif
+
+	Map* map = new Map;
+	map->Ensure(kBase, kPages);
+	for (size_t i = 0; i < kPages; ++i)
+		map->set(kBase + i, (void*)(uintptr_t)(i + 1));
+
+	RunMicroBench("PageMap get (sequential)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+			DoNotOptimize(map->get(kBase + (i & (kPages - 1))));
+		timer.Stop();
+	});
+
+	// 随机页号提前生成好，查找本身的缓存未命中才是要测的
+	std::vector<PAGE_ID> ids(1 << 16);
+	uint64_t rng = 88172645463325252ULL;
+	for (auto& id : ids)
+	{
+		rng ^= rng << 13;
+		rng ^= rng >> 7;
+		rng ^= rng << 17;
+		id = kBase + (rng & (kPages - 1));
+	}
+
+	RunMicroBench("PageMap get (random)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+			DoNotOptimize(map->get(ids[i & (ids.size() - 1)]));
+		timer.Stop();
+	});
+
+	// 真实的对象地址，经过MapObjectToSpan
+	std::vector<void*> objs(4096);
+	for (auto& p : objs)
+		p = ConcurrentAlloc(64);
+
+	PageCache* pc = PageCache::GetInstance();
+	RunMicroBench("PageCache MapObjectToSpan", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+			DoNotOptimize(pc->MapObjectToSpan(objs[i & (objs.size() - 1)]));
+		timer.Stop();
+	});
+
+	for (auto p : objs)
+		ConcurrentFree(p);
+
+	return 0;
+}
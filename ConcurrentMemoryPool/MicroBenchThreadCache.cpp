@@ -0,0 +1,89 @@
+﻿#include "MicroBench.h"
+#include "ThreadCache.h"
+#include "CentralCache.h"
+
+#include <vector>
+
+// ThreadCache：自由链表命中时的申请/释放，以及从CentralCache批量补充
+int main()
+{
+	const size_t kSize = 64;
+	const size_t kIndex = SizeClass::Index(kSize);
+	const size_t kBatch = SizeClass::Info(kIndex)._batch;
+
+	ThreadCache* tc = new ThreadCache;
+
+	// 先让慢开始的批量涨到上限
+	std::vector<void*> objs(kBatch * 4);
+	for (int round = 0; round < 8; ++round)
+	{
+		for (auto& p : objs)
+			p = tc->Allocate(kSize);
+		for (auto p : objs)
+			tc->Deallocate(p, kSize);
+	}
+
+	const size_t kOps = 1 << 20;
+	RunMicroBench("ThreadCache Allocate+Deallocate hit (pair)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; ++i)
+		{
+			void* p = tc->Allocate(kSize);
+			DoNotOptimize(p);
+			tc->Deallocate(p, kSize);
+		}
+		timer.Stop();
+	});
+
+	// 一次申请/释放64个：只查一次桶，整段进出自由链表，对比逐个申请/释放
+	const size_t kN = 64;
+	void* many[kN];
+	RunMicroBench("ThreadCache Allocate/Deallocate x64 (per object)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; i += kN)
+		{
+			for (size_t j = 0; j < kN; ++j)
+				many[j] = tc->Allocate(kSize);
+			DoNotOptimize(many);
+			for (size_t j = 0; j < kN; ++j)
+				tc->Deallocate(many[j], kSize);
+		}
+		timer.Stop();
+	});
+
+	RunMicroBench("ThreadCache AllocateBatch/DeallocateBatch x64 (per object)", kOps, [&](MicroTimer& timer) {
+		timer.Start();
+		for (size_t i = 0; i < kOps; i += kN)
+		{
+			tc->AllocateBatch(kSize, kN, many);
+			DoNotOptimize(many);
+			tc->DeallocateBatch(many, kN, kSize);
+		}
+		timer.Stop();
+	});
+
+	// 每次补充一整批：补充之后把这一批申请出来再释放，ListTooLong把它们还回中转缓存，
+	// 下一次补充的代价就是稳态下的代价
+	// 补充和清空必须交替进行，只能逐次计时，每次Start/Stop的开销由RunMicroBench扣掉
+	const size_t kRefills = 2048;
+	std::vector<void*> batch;
+	batch.reserve(kBatch);
+	RunMicroBench("ThreadCache FetchFromCentralCache refill", kRefills, [&](MicroTimer& timer) {
+		for (size_t i = 0; i < kRefills; ++i)
+		{
+			timer.Start();
+			void* p = tc->FetchFromCentralCache(kIndex, SizeClass::ClassSize(kIndex));
+			timer.Stop();
+
+			batch.clear();
+			batch.push_back(p);
+			while (batch.size() < kBatch)
+				batch.push_back(tc->Allocate(kSize));
+			for (auto q : batch)
+				tc->Deallocate(q, kSize);
+		}
+	});
+
+	delete tc;
+	return 0;
+}
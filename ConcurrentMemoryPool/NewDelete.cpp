@@ -0,0 +1,141 @@
+﻿#include "ConcurrentAlloc.h"
+
+#include <new>
+
+// 把全局的operator new/delete替换为内存池
+// 单独成一个库(ConcurrentMemoryPoolNewDelete)，需要的程序链接它即可，不链接则不受影响
+// 编译器知道对象大小时会调用sized delete，走ConcurrentFree(ptr, size)，省掉一次基数树查找
+
+// operator new返回的地址要满足 __STDCPP_DEFAULT_NEW_ALIGNMENT__ 对齐
+// 不超过128字节的桶是按8字节分档的，把size向上取整到16的倍数，落到的桶对象大小都是16的倍数
+// 超过128字节的桶本身都是16的倍数；span起始地址按页对齐，所以桶内对象都按16对齐
+// sized delete必须做同样的换算，才能映射回申请时的桶
+static const size_t NEW_ALIGN = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+static_assert(NEW_ALIGN <= 16, "size classes above 128 bytes are only 16-byte aligned");
+
+static inline size_t NewSize(size_t size)
+{
+	return size < NEW_ALIGN ? size : SizeClass::_RoundUp(size, NEW_ALIGN);
+}
+
+void* operator new(size_t size)
+{
+	return ConcurrentAlloc(NewSize(size));
+}
+
+void* operator new[](size_t size)
+{
+	return ConcurrentAlloc(NewSize(size));
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	try
+	{
+		return ConcurrentAlloc(NewSize(size));
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	if (ptr != nullptr)
+		ConcurrentFree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	if (ptr != nullptr)
+		ConcurrentFree(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept
+{
+	if (ptr != nullptr)
+		ConcurrentFree(ptr, NewSize(size));
+}
+
+void operator delete[](void* ptr, size_t size) noexcept
+{
+	if (ptr != nullptr)
+		ConcurrentFree(ptr, NewSize(size));
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+	return ConcurrentAllocAligned(size, (size_t)align);
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+	return ConcurrentAllocAligned(size, (size_t)align);
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	try
+	{
+		return ConcurrentAllocAligned(size, (size_t)align);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+	return operator new(size, align, std::nothrow);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	if (ptr != nullptr)
+		ConcurrentFree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+	if (ptr != nullptr)
+		ConcurrentFree(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete(void* ptr, size_t size, std::align_val_t align) noexcept
+{
+	if (ptr != nullptr)
+		ConcurrentFreeAligned(ptr, size, (size_t)align);
+}
+
+void operator delete[](void* ptr, size_t size, std::align_val_t align) noexcept
+{
+	if (ptr != nullptr)
+		ConcurrentFreeAligned(ptr, size, (size_t)align);
+}
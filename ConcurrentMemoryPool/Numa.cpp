@@ -0,0 +1,166 @@
+﻿#include "Numa.h"
+
+#include <cstdio>
+
+#if defined(__linux__)
+	#include <fcntl.h>
+	#include <sched.h>
+	#include <sys/syscall.h>
+#endif
+
+std::atomic<size_t> Numa::_num_nodes(0);
+std::atomic<NumaStealPolicy> Numa::_steal_policy(NumaStealPolicy::Never);
+
+// CPU编号到节点的映射，编号超出表的CPU按取模处理
+static const size_t MAX_CPUS = 1024;
+static unsigned char cpu_to_node[MAX_CPUS];
+static size_t system_nodes = 1;		// 系统实际的节点数，mbind只能绑定到这些节点
+static std::mutex detect_mtx;
+
+// 固定到的节点，-1表示按CPU选择
+static thread_local int tls_node = -1;
+
+#if defined(__linux__)
+// 读一个sysfs文件到buf，不能用fopen/ifstream：探测发生在第一次申请内存的途中
+static bool ReadSmallFile(const char* path, char* buf, size_t size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	ssize_t n = read(fd, buf, size - 1);
+	close(fd);
+	if (n <= 0)
+		return false;
+
+	buf[n] = '\0';
+	return true;
+}
+
+// 解析"0-3,8-11"这样的列表，对每个编号调用fn
+template<class Fn>
+static void ForEachInList(const char* s, Fn fn)
+{
+	while (*s != '\0' && *s != '\n')
+	{
+		size_t first = 0;
+		while (*s >= '0' && *s <= '9')
+			first = first * 10 + (size_t)(*s++ - '0');
+
+		size_t last = first;
+		if (*s == '-')
+		{
+			++s;
+			last = 0;
+			while (*s >= '0' && *s <= '9')
+				last = last * 10 + (size_t)(*s++ - '0');
+		}
+
+		for (size_t i = first; i <= last; ++i)
+			fn(i);
+
+		if (*s != ',')
+			break;
+		++s;
+	}
+}
+#endif
+
+size_t Numa::Detect()
+{
+	std::unique_lock<std::mutex> lock(detect_mtx);
+
+	size_t n = _num_nodes.load(std::memory_order_relaxed);
+	if (n != 0)
+		return n;
+
+	n = 1;
+#if defined(__linux__)
+	char buf[4096];
+	if (ReadSmallFile("/sys/devices/system/node/online", buf, sizeof(buf)))
+	{
+		ForEachInList(buf, [&](size_t node) {
+			if (node < MAX_NUMA_NODES && node + 1 > n)
+				n = node + 1;
+		});
+	}
+
+	for (size_t node = 0; node < n; ++node)
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+		if (!ReadSmallFile(path, buf, sizeof(buf)))
+			continue;
+
+		ForEachInList(buf, [&](size_t cpu) {
+			if (cpu < MAX_CPUS)
+				cpu_to_node[cpu] = (unsigned char)node;
+		});
+	}
+#endif
+
+	system_nodes = n;
+	_num_nodes.store(n, std::memory_order_release);
+	return n;
+}
+
+size_t Numa::CurrentNode()
+{
+	size_t n = NumNodes();
+	if (n <= 1)
+		return 0;
+
+	if (tls_node >= 0)
+		return (size_t)tls_node % n;
+
+#if defined(__linux__)
+	int cpu = sched_getcpu();
+	if (cpu < 0)
+		return 0;
+
+	if ((size_t)cpu < MAX_CPUS)
+		return cpu_to_node[cpu] % n;
+	return (size_t)cpu % n;
+#else
+	return 0;
+#endif
+}
+
+void Numa::SetThreadNode(int node)
+{
+	tls_node = node;
+}
+
+void Numa::SimulateNodes(size_t n)
+{
+	NumNodes();
+
+	std::unique_lock<std::mutex> lock(detect_mtx);
+	if (n > MAX_NUMA_NODES)
+		n = MAX_NUMA_NODES;
+	if (n <= _num_nodes.load(std::memory_order_relaxed))
+		return;
+
+	for (size_t cpu = 0; cpu < MAX_CPUS; ++cpu)
+		cpu_to_node[cpu] = (unsigned char)(cpu % n);
+
+	_num_nodes.store(n, std::memory_order_release);
+}
+
+void Numa::BindToNode(void* ptr, size_t bytes, size_t node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	// 模拟出来的节点不存在，不绑定
+	if (node >= system_nodes || system_nodes <= 1)
+		return;
+
+	// 不依赖libnuma，直接发系统调用；失败（比如内核不支持NUMA）时保持默认的first-touch
+	const int MPOL_PREFERRED_MODE = 1;
+	unsigned long mask = 1UL << node;
+	syscall(SYS_mbind, ptr, bytes, MPOL_PREFERRED_MODE, &mask, sizeof(mask) * 8 + 1, 0);
+#else
+	(void)ptr;
+	(void)bytes;
+	(void)node;
+#endif
+}
@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include "Common.h"
+
+// NUMA节点的拓扑，以及PageCache/CentralCache按节点分实例用到的策略
+//
+// 每个节点一个PageCache和CentralCache，ThreadCache从当前CPU所在节点的实例批量获取；
+// 对象释放时按span上记录的节点还给它所属的实例，不会在节点之间混用
+// PageCache向系统申请的内存用mbind(MPOL_PREFERRED)绑定到本节点，物理页不取决于谁先访问
+//
+// 只有一个节点（或者不是linux）时所有的查询都直接返回节点0，与原来的单实例完全相同
+static const size_t MAX_NUMA_NODES = 8;
+
+// 本节点的page heap没有空闲span时的做法
+enum class NumaStealPolicy
+{
+	Never,			// 总是向系统申请本节点的内存（默认）
+	BeforeSystem,	// 先从其它节点的page heap取一个空闲span（对方的锁空闲时），都没有再向系统申请
+};
+
+class Numa
+{
+private:
+	static std::atomic<size_t> _num_nodes;		// 0表示还没有探测
+	static std::atomic<NumaStealPolicy> _steal_policy;
+
+	static size_t Detect();
+
+public:
+	// 节点个数，第一次调用时从/sys/devices/system/node探测
+	static size_t NumNodes()
+	{
+		size_t n = _num_nodes.load(std::memory_order_acquire);
+		return n != 0 ? n : Detect();
+	}
+
+	// 当前线程应该使用的节点：SetThreadNode指定的节点，或者当前CPU所在的节点
+	static size_t CurrentNode();
+
+	// 把当前线程固定到node申请内存（不改变线程的CPU亲和性），-1恢复按CPU选择
+	static void SetThreadNode(int node);
+
+	// 按n个节点运行，CPU按编号取模分到各个节点，用于在单节点的机器上验证多节点的路径
+	// 节点数只能增加：已经分配出去的span记录的节点编号必须一直有效
+	static void SimulateNodes(size_t n);
+
+	// 把[ptr, ptr + bytes)的物理页优先放在node上，必须在第一次访问之前调用
+	static void BindToNode(void* ptr, size_t bytes, size_t node);
+
+	static NumaStealPolicy StealPolicy()
+	{
+		return _steal_policy.load(std::memory_order_relaxed);
+	}
+
+	static void SetStealPolicy(NumaStealPolicy policy)
+	{
+		_steal_policy.store(policy, std::memory_order_relaxed);
+	}
+};
+
+// 设置节点之间互相借用空闲span的策略
+inline void ConcurrentSetNumaStealPolicy(NumaStealPolicy policy)
+{
+	Numa::SetStealPolicy(policy);
+}
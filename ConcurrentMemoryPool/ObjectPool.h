@@ -2,6 +2,8 @@
 
 #include "Common.h"
 
+#include <utility>
+
 #ifdef _WIN32
 	#include <Windows.h>
 #else
@@ -17,59 +19,487 @@
 template<typename T>
 class ObjectPool
 {
+	template<typename, size_t>
+	friend class ConcurrentObjectPool;
+
+public:
+	// 每个对象占用的空间：至少能放下一个指针，并且是alignof(T)的整数倍，保证连续切出来的对象都是对齐的
+	// 写成函数而不是静态常量：成员里有ObjectPool<T>时T可能还没有定义完整
+	static constexpr size_t ObjSize()
+	{
+		return SizeClass::_RoundUp(sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T), alignof(T));
+	}
+
+	// 每次向OS申请的大块空间：至少128KB、至少放得下8个对象，按页取整
+	// 按ObjSize()切完之后剩下的尾巴不到一个对象，换新的大块时几乎没有浪费
+	static constexpr size_t ChunkBytes()
+	{
+		return SizeClass::_RoundUp(ObjSize() * 8 > 128 * 1024 ? ObjSize() * 8 : 128 * 1024, (size_t)1 << PAGE_SHIFT);
+	}
+
 private:
 	char* _memory = nullptr;     // 向OS申请的一大块内存空间
 	size_t _remain_bytes = 0;	 // 大块空间中在切分过程中剩余字节数
 	void* _free_list = nullptr;	 // 管理被释放返还的空间的链表的头指针
 
-public:
-	// 去获得一个T类型的对象（他所需要的空间就是定长的）
+	// 取一块未构造的空间
 	// 获取空间的思路： 优先从_free_list中获取；
 	//					如果 _free_list==nullptr，从_memory中获取；如果_memory剩余空间不够一个T类型对象，再向OS申请空间
-	T* New()
+	void* Take()
 	{
-		T* obj = nullptr;
+		void* obj = nullptr;
 
 		if (_free_list != nullptr)
 		{										
 			void* next = *((void**)_free_list); // 取下一个链表节点的指针
-			obj = (T*)_free_list;
+			obj = _free_list;
 			_free_list = next;
 		}
 		else
 		{
-			if (_remain_bytes < sizeof(T))	//两种情况：1 程序刚启动，_memory==nullptr  2.剩余空间不足
+			if (_remain_bytes < ObjSize())	//两种情况：1 程序刚启动，_memory==nullptr  2.剩余空间不足
 			{
-				_remain_bytes = 128 * 1024;
-				_memory = (char*)SystemAlloc(_remain_bytes >> 13);
-				if (nullptr == _memory)
-				{
-					throw std::bad_alloc();
-				}
+				Refill();
 			}
 
-			obj = (T*)_memory;
+			obj = _memory;
+			_memory += ObjSize();
+			_remain_bytes -= ObjSize();
+		}
+
+		return obj;
+	}
+
+	// 还回一块未构造(已经析构)的空间，push_front
+	void Give(void* obj)
+	{
+		*(void**)obj = _free_list; //  *(void**) 使用链表节点的头4/8个字节存储指针
+		_free_list = obj;
+	}
 
-			// 确保一个T对象的所用空间一个能够存放一个指针
-			size_t objSize = sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T);
-			_memory += objSize;
-			_remain_bytes -= objSize;
+	void Refill()
+	{
+		static_assert(alignof(T) <= ((size_t)1 << PAGE_SHIFT), "ObjectPool: alignment larger than a page");
+
+		_memory = (char*)SystemAlloc(ChunkBytes() >> PAGE_SHIFT);
+		if (nullptr == _memory)
+		{
+			throw std::bad_alloc();
 		}
+		_remain_bytes = ChunkBytes();
+	}
 
-		// 定位new，显示调用T的构造函数初始化
-		new(obj)T;
+public:
+	// 去获得一个T类型的对象（他所需要的空间就是定长的），参数原样转发给T的构造函数
+	template<class... Args>
+	T* New(Args&&... args)
+	{
+		void* obj = Take();
 
-		return obj;
+		// 定位new，显示调用T的构造函数初始化；构造失败时把空间还回去
+		try
+		{
+			return new(obj)T(std::forward<Args>(args)...);
+		}
+		catch (...)
+		{
+			Give(obj);
+			throw;
+		}
 	}
 
 	void Delete(T* obj)
 	{
 		// 显示调用析构函数清理对象
 		obj->~T();
+		Give(obj);
+	}
 
-		// push_front
-		*(void**)obj = _free_list; //  *(void**) 使用链表节点的头4/8个字节存储指针
-		_free_list = obj;
+	// 一次获得n个对象放进objs，每个都用args构造
+	// 先取空闲链表上的，不够的部分从大块空间中连续切出来，不再逐个判断剩余空间
+	template<class... Args>
+	void NewN(T** objs, size_t n, const Args&... args)
+	{
+		size_t i = 0;
+		for (; i < n && _free_list != nullptr; ++i)
+		{
+			objs[i] = (T*)Take();
+		}
+
+		while (i < n)
+		{
+			if (_remain_bytes < ObjSize())
+			{
+				try
+				{
+					Refill();
+				}
+				catch (...)
+				{
+					for (size_t j = 0; j < i; ++j)
+						Give(objs[j]);
+					throw;
+				}
+			}
+
+			size_t count = std::min(n - i, _remain_bytes / ObjSize());
+			for (size_t j = 0; j < count; ++j)
+			{
+				objs[i + j] = (T*)(_memory + j * ObjSize());
+			}
+			_memory += count * ObjSize();
+			_remain_bytes -= count * ObjSize();
+			i += count;
+		}
+
+		// 构造失败时析构已经构造好的，所有空间都还回去
+		size_t built = 0;
+		try
+		{
+			for (; built < n; ++built)
+			{
+				new(objs[built])T(args...);
+			}
+		}
+		catch (...)
+		{
+			for (size_t j = 0; j < n; ++j)
+			{
+				if (j < built)
+					objs[j]->~T();
+				Give(objs[j]);
+			}
+			throw;
+		}
+	}
+
+	// 一次释放n个对象：先串成一条链，再整条挂到空闲链表上
+	void DeleteN(T** objs, size_t n)
+	{
+		if (n == 0)
+			return;
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			objs[i]->~T();
+			*(void**)objs[i] = i + 1 < n ? (void*)objs[i + 1] : _free_list;
+		}
+		_free_list = objs[0];
 	}
 };
 
+// 多线程共用的定长对象池（Bonwick的magazine分层）
+// 每个线程对每个池持有两个magazine（各装最多MAGAZINE_SIZE个空闲对象），New/Delete绝大多数时候只访问它们，不加锁
+// 两个都空/都满时，才到共享的depot（加锁）换一整个满的/空的magazine；depot也没有时从底层ObjectPool切满一个magazine
+//
+// 线程退出时把手里的magazine还给depot；池可以先于用过它的线程销毁（与ObjectPool一样不归还内存）：
+// 活着的池都登记在一个全局链表里，每个池有唯一的编号，线程只在池还活着时才把magazine还回去，
+// 同一地址上新建的池编号不同，不会接手旧池留在线程里的magazine
+// 一个线程同时使用的同类型池超过MAX_LOCAL_POOLS个时，多出来的池直接走depot
+template<typename T, size_t MAGAZINE_SIZE = 32>
+class ConcurrentObjectPool
+{
+private:
+	struct Magazine
+	{
+		Magazine* _next = nullptr;		// depot中的链表
+		size_t _count = 0;
+		void* _objs[MAGAZINE_SIZE];
+	};
+
+	// 一个线程在一个池上的两个magazine：_loaded为空时与_previous交换，两个都不能用时才去depot
+	struct LocalCache
+	{
+		ConcurrentObjectPool* _pool = nullptr;
+		size_t _pool_id = 0;			// 与_pool->_id相同才是同一个池
+		Magazine* _loaded = nullptr;
+		Magazine* _previous = nullptr;
+	};
+
+	static const size_t MAX_LOCAL_POOLS = 4;
+
+	struct LocalCaches
+	{
+		LocalCache _caches[MAX_LOCAL_POOLS];
+		size_t _seen_destroyed = 0;		// 上次清理时Registry::_destroyed的值
+
+		~LocalCaches()
+		{
+			Registry* registry = GetRegistry();
+			std::unique_lock<std::mutex> lock(registry->_mtx);
+			for (LocalCache& cache : _caches)
+			{
+				if (cache._pool != nullptr && IsLive(cache))
+				{
+					cache._pool->Flush(cache);
+				}
+				cache._pool = nullptr;
+			}
+		}
+	};
+
+	// 所有活着的池；同时要加锁时先Registry::_mtx，后池的_mtx
+	struct Registry
+	{
+		std::mutex _mtx;
+		ConcurrentObjectPool* _head = nullptr;
+		size_t _next_id = 0;
+		std::atomic<size_t> _destroyed{ 0 };	// 销毁过的池的个数
+	};
+
+	// 不析构：线程退出晚于静态对象析构时也还能用
+	static Registry* GetRegistry()
+	{
+		alignas(Registry) static char storage[sizeof(Registry)];
+		static Registry* registry = new(storage) Registry;
+		return registry;
+	}
+
+	// 调用前持有Registry::_mtx
+	static bool IsLive(const LocalCache& cache)
+	{
+		for (ConcurrentObjectPool* pool = GetRegistry()->_head; pool != nullptr; pool = pool->_next_live)
+		{
+			if (pool == cache._pool)
+				return pool->_id == cache._pool_id;
+		}
+		return false;
+	}
+
+	// depot：满的（包括线程退出时还回来的不满的）和空的magazine，以及切新对象的底层池
+	Magazine* _full = nullptr;
+	Magazine* _empty = nullptr;
+	ObjectPool<T> _backing;
+	ObjectPool<Magazine> _magazine_pool;
+	std::mutex _mtx;
+
+	size_t _id = 0;
+	ConcurrentObjectPool* _prev_live = nullptr;
+	ConcurrentObjectPool* _next_live = nullptr;
+
+private:
+	// 当前线程在这个池上的magazine，第一次使用时从depot领两个空的
+	LocalCache* Local()
+	{
+		static thread_local LocalCaches tls_caches;
+
+		LocalCache* unused = nullptr;
+		for (LocalCache& cache : tls_caches._caches)
+		{
+			if (cache._pool == this && cache._pool_id == _id)
+				return &cache;
+			if (cache._pool == nullptr && unused == nullptr)
+				unused = &cache;
+		}
+
+		// 位置都占满了，并且上次检查之后有池销毁过：销毁的池留下的位置清掉，magazine里的空间随旧池一起不再使用
+		// 没有池销毁时不碰全局锁，走depot的池不会因此互相等待
+		Registry* registry = GetRegistry();
+		if (unused == nullptr && tls_caches._seen_destroyed != registry->_destroyed.load(std::memory_order_acquire))
+		{
+			std::unique_lock<std::mutex> registry_lock(registry->_mtx);
+			tls_caches._seen_destroyed = registry->_destroyed.load(std::memory_order_relaxed);
+			for (LocalCache& cache : tls_caches._caches)
+			{
+				if (!IsLive(cache))
+					cache._pool = nullptr;
+				if (cache._pool == nullptr && unused == nullptr)
+					unused = &cache;
+			}
+		}
+
+		if (unused != nullptr)
+		{
+			std::unique_lock<std::mutex> lock(_mtx);
+			unused->_loaded = PopEmpty();
+			unused->_previous = PopEmpty();
+			unused->_pool = this;
+			unused->_pool_id = _id;
+		}
+		return unused;
+	}
+
+	// 以下调用前持有_mtx
+	Magazine* PopEmpty()
+	{
+		Magazine* mag = _empty;
+		if (mag != nullptr)
+		{
+			_empty = mag->_next;
+		}
+		else
+		{
+			mag = _magazine_pool.New();
+		}
+		mag->_next = nullptr;
+		return mag;
+	}
+
+	void PushMagazine(Magazine* mag)
+	{
+		Magazine*& list = mag->_count > 0 ? _full : _empty;
+		mag->_next = list;
+		list = mag;
+	}
+
+	void Flush(LocalCache& cache)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+		PushMagazine(cache._loaded);
+		PushMagazine(cache._previous);
+		cache._pool = nullptr;
+	}
+
+	// 本线程的两个magazine都空了：空的_previous换depot里一个满的
+	void* AllocateSlow(LocalCache* cache)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+
+		if (cache != nullptr && _full != nullptr)
+		{
+			Magazine* full = _full;
+			_full = full->_next;
+
+			PushMagazine(cache->_previous);
+			cache->_previous = cache->_loaded;
+			cache->_loaded = full;
+			return full->_objs[--full->_count];
+		}
+
+		// 没有本线程缓存的池，也先用depot里的对象
+		if (cache == nullptr && _full != nullptr)
+		{
+			Magazine* mag = _full;
+			void* obj = mag->_objs[--mag->_count];
+			if (mag->_count == 0)
+			{
+				_full = mag->_next;
+				PushMagazine(mag);
+			}
+			return obj;
+		}
+
+		if (cache == nullptr)
+		{
+			return _backing.Take();
+		}
+
+		// depot里也没有：一次从底层池切满一个magazine，之后MAGAZINE_SIZE-1次New都不用再加锁
+		Magazine* mag = cache->_loaded;
+		while (mag->_count < MAGAZINE_SIZE)
+		{
+			mag->_objs[mag->_count++] = _backing.Take();
+		}
+		return mag->_objs[--mag->_count];
+	}
+
+	// 本线程的两个magazine都满了：满的_previous交给depot，换一个空的
+	void DeallocateSlow(LocalCache* cache, void* obj)
+	{
+		std::unique_lock<std::mutex> lock(_mtx);
+
+		if (cache != nullptr)
+		{
+			PushMagazine(cache->_previous);
+			cache->_previous = cache->_loaded;
+			cache->_loaded = PopEmpty();
+			cache->_loaded->_objs[cache->_loaded->_count++] = obj;
+			return;
+		}
+
+		Magazine* mag = _full;
+		if (mag == nullptr || mag->_count == MAGAZINE_SIZE)
+		{
+			mag = PopEmpty();
+			mag->_next = _full;
+			_full = mag;
+		}
+		mag->_objs[mag->_count++] = obj;
+	}
+
+public:
+	ConcurrentObjectPool()
+	{
+		Registry* registry = GetRegistry();
+		std::unique_lock<std::mutex> lock(registry->_mtx);
+		_id = ++registry->_next_id;
+		_next_live = registry->_head;
+		if (_next_live != nullptr)
+			_next_live->_prev_live = this;
+		registry->_head = this;
+	}
+
+	// 别的线程手里这个池的magazine不再还回来，下次用到那个位置或线程退出时丢掉
+	~ConcurrentObjectPool()
+	{
+		Registry* registry = GetRegistry();
+		std::unique_lock<std::mutex> lock(registry->_mtx);
+		if (_prev_live != nullptr)
+			_prev_live->_next_live = _next_live;
+		else
+			registry->_head = _next_live;
+		if (_next_live != nullptr)
+			_next_live->_prev_live = _prev_live;
+		registry->_destroyed.fetch_add(1, std::memory_order_release);
+	}
+
+	ConcurrentObjectPool(const ConcurrentObjectPool&) = delete;
+	ConcurrentObjectPool& operator=(const ConcurrentObjectPool&) = delete;
+
+	template<class... Args>
+	T* New(Args&&... args)
+	{
+		LocalCache* cache = Local();
+		void* obj = nullptr;
+
+		if (cache != nullptr && cache->_loaded->_count > 0)
+		{
+			obj = cache->_loaded->_objs[--cache->_loaded->_count];
+		}
+		else if (cache != nullptr && cache->_previous->_count > 0)
+		{
+			std::swap(cache->_loaded, cache->_previous);
+			obj = cache->_loaded->_objs[--cache->_loaded->_count];
+		}
+		else
+		{
+			obj = AllocateSlow(cache);
+		}
+
+		try
+		{
+			return new(obj)T(std::forward<Args>(args)...);
+		}
+		catch (...)
+		{
+			DeallocateRaw(obj);
+			throw;
+		}
+	}
+
+	void Delete(T* obj)
+	{
+		obj->~T();
+		DeallocateRaw(obj);
+	}
+
+private:
+	// 还回一块已经析构的空间
+	void DeallocateRaw(void* obj)
+	{
+		LocalCache* cache = Local();
+		if (cache != nullptr && cache->_loaded->_count < MAGAZINE_SIZE)
+		{
+			cache->_loaded->_objs[cache->_loaded->_count++] = obj;
+		}
+		else if (cache != nullptr && cache->_previous->_count == 0)
+		{
+			std::swap(cache->_loaded, cache->_previous);
+			cache->_loaded->_objs[cache->_loaded->_count++] = obj;
+		}
+		else
+		{
+			DeallocateSlow(cache, obj);
+		}
+	}
+};
@@ -1,92 +1,670 @@
 ﻿#include "PageCache.h"
+#include "MallocStats.h"
+#include "CentralCache.h"
 
-PageCache PageCache::_instance_page;
+std::atomic<PageCache*> PageCache::_instances[MAX_NUMA_NODES];
+
+// 页号到span的映射所有节点共用：对象释放时还不知道属于哪个节点，要先查到span
+static SpanMap& SharedSpanMap()
+{
+	alignas(SpanMap) static char storage[sizeof(SpanMap)];
+	static SpanMap* map = new(storage) SpanMap;
+	return *map;
+}
+
+static std::mutex map_mtx;			// 基数树建节点(Ensure)用，不同的页set互不影响
+static std::mutex instances_mtx;
+
+PageCache::PageCache(size_t node)
+	: _node(node)
+	, _id_span_map(SharedSpanMap())
+	, _large_by_size(LargeIndexAllocator<Span*>(node))
+	, _large_by_address(LargeIndexAllocator<Span*>(node))
+{}
+
+PageCache* PageCache::CreateInstance(size_t node)
+{
+	assert(node < MAX_NUMA_NODES);
+
+	alignas(PageCache) static char storage[MAX_NUMA_NODES][sizeof(PageCache)];
+
+	std::unique_lock<std::mutex> lock(instances_mtx);
+	PageCache* instance = _instances[node].load(std::memory_order_relaxed);
+	if (instance == nullptr)
+	{
+		instance = new(storage[node]) PageCache(node);
+		_instances[node].store(instance, std::memory_order_release);
+	}
+	return instance;
+}
+
+Span* PageCache::NewSpanObject()
+{
+	Span* span = _span_pool.New();
+	span->_node.store((unsigned char)_node, std::memory_order_relaxed);
+	return span;
+}
+
+Span* PageCache::NewLargeSpanObject()
+{
+	Span* span = _large_span_pool.New();
+	span->_node.store((unsigned char)_node, std::memory_order_relaxed);
+	span->_is_use = true;
+	return span;
+}
 
 // 获取一个k页的span
 Span* PageCache::NewSpan(size_t k)
 {
 	assert(k > 0);
 
-	// 大于128 page的直接向堆申请
+	// 大于128 page的直接向堆申请，不需要_page_mtx
 	if (k > NUM_PAGE - 1)
 	{
-		void* ptr = SystemAlloc(k);
-		//Span* span = new Span;
-		Span* span = _span_pool.New();
+		return NewLargeSpan(k);
+	}
 
-		span->_page_id = (PAGE_ID)ptr >> PAGE_SHIFT;
-		span->_page_num = k;
+	// 第k个桶，或者后面比k大的桶里最小的非空桶，有就从中切出k页
+	size_t i = FindSpanList(k);
+	if (i != 0)
+	{
+		Span* span = FirstSpan(i);
+		EraseSpan(span);
+		return CarveSpan(span, k);
+	}
+
+	// 本节点没有空闲span了，策略允许时先从其它节点借
+	if (Numa::StealPolicy() == NumaStealPolicy::BeforeSystem)
+	{
+		Span* span = StealSpan(k);
+		if (span != nullptr)
+		{
+			return span;
+		}
+	}
+
+	// 走到这个位置了，就说明后面没有大页的span了
+	// 这时，向堆要一个128页的span（系统调用期间不持有_page_mtx），直接从中切出k页
+	return CarveSpan(NewSystemSpan(NUM_PAGE - 1), k);
+}
+
+Span* PageCache::StealSpan(size_t k)
+{
+	size_t num_nodes = Numa::NumNodes();
+	for (size_t i = 1; i < num_nodes; ++i)
+	{
+		PageCache* other = GetInstance((_node + i) % num_nodes);
+
+		// 已经持有本节点的_page_mtx，只能try_lock，否则两个节点互相借时会死锁
+		if (!other->_page_mtx.try_lock())
+			continue;
+
+		// 切出来的k页归本节点所有，以后还给本节点的空闲链表
+		// 两个节点的锁都拿着的时候改_node：对方节点合并时要么看到它还在使用，要么看到它已经不属于自己
+		Span* span = nullptr;
+		size_t n = other->FindSpanList(k);
+		if (n != 0)
+		{
+			span = other->FirstSpan(n);
+			other->EraseSpan(span);
+			span = other->CarveSpan(span, k);
+			span->_node.store((unsigned char)_node, std::memory_order_relaxed);
+		}
+		other->_page_mtx.unlock();
+
+		if (span != nullptr)
+		{
+			return span;
+		}
+	}
+
+	return nullptr;
+}
+
+Span* PageCache::CarveSpan(Span* span, size_t k)
+{
+	assert(span->_page_num >= k);
+
+	Span* need_span = span;
+	if (span->_page_num > k)
+	{
+		//Span* need_span = new Span;
+		need_span = NewSpanObject();
+
+		// 在span的头部切一个k页下来
+		// k页返回
+		// span剩下的部分挂到对应映射的位置
+		need_span->_page_id = span->_page_id;
+		need_span->_page_num = k;
+
+		span->_page_id += k;
+		span->_page_num -= k;
+
+		// 切下来的部分继承归还状态，只重新提交交出去的k页
+		need_span->_is_returned = span->_is_returned;
+
+		PushSpan(span);
 
-		//_id_span_map[span->_page_id] = span;
+		// 存储span的首尾页号与span映射
+		// 方便PageCache回收内存时，进行的合并查找
 		_id_span_map.set(span->_page_id, span);
-		return span;
+		_id_span_map.set(span->_page_id + span->_page_num - 1, span);
+	}
+
+	CommitSpan(need_span);
+
+	// 建立id与span的映射，方便CentralCache回收小块内存时，查找对应的span
+	//注意：need_span的每一个页面都需要注册，因为 obj的ptr-> span的_page_id -> span
+	for (PAGE_ID i = 0; i < need_span->_page_num; ++i)
+	{
+		_id_span_map.set(need_span->_page_id + i, need_span);
+	}
+
+	need_span->_is_use = true;
+	return need_span;
+}
+
+void* PageCache::SystemAllocOnNode(size_t kpage, size_t align_pages)
+{
+	void* ptr = SystemAlloc(kpage, align_pages);
+	if (Numa::NumNodes() > 1)
+	{
+		Numa::BindToNode(ptr, kpage << PAGE_SHIFT, _node);
+	}
+	return ptr;
+}
+
+void* PageCache::SystemAllocUnlocked(size_t kpage, size_t align_pages)
+{
+	_page_mtx.unlock();
+
+	void* ptr = nullptr;
+	try
+	{
+		ptr = SystemAllocOnNode(kpage, align_pages);
+	}
+	catch (...)
+	{
+		// 调用方认为自己仍然持有锁
+		_page_mtx.lock();
+		throw;
+	}
+
+	_page_mtx.lock();
+	_mapped_pages += kpage;
+
+	return ptr;
+}
+
+Span* PageCache::NewSystemSpan(size_t kpage, size_t align_pages)
+{
+	void* ptr = SystemAllocUnlocked(kpage, align_pages);
+
+	// 不超过128页的span释放后会进入空闲链表，要用_span_pool的Span
+	Span* span = NewSpanObject();
+	span->_page_id = (PAGE_ID)ptr >> PAGE_SHIFT;
+	span->_page_num = kpage;
+
+	// 新来的页在基数树上可能还没有节点，先建好，后面的set才不会越界
+	if (!EnsureMap(span->_page_id, span->_page_num))
+		throw std::bad_alloc();
+
+	return span;
+}
+
+void PageCache::PushSpan(Span* span)
+{
+	size_t n = span->_page_num;
+	SpanList& list = span->_is_returned ? _returned_lists[n] : _span_lists[n];
+	list.PushFront(span);
+	_nonempty[n / 64] |= (uint64_t)1 << (n % 64);
+}
+
+void PageCache::EraseSpan(Span* span)
+{
+	size_t n = span->_page_num;
+	SpanList& list = span->_is_returned ? _returned_lists[n] : _span_lists[n];
+	list.Erase(span);
+	if (_span_lists[n].Empty() && _returned_lists[n].Empty())
+	{
+		_nonempty[n / 64] &= ~((uint64_t)1 << (n % 64));
 	}
+}
 
-	// 先检查第k个span桶有没有span
-	if (!_span_lists[k].Empty())
+Span* PageCache::FirstSpan(size_t i)
+{
+	if (!_span_lists[i].Empty())
 	{
-		Span* need_span = _span_lists[k].PopFront();
+		return _span_lists[i].Begin();
+	}
+	return _returned_lists[i].Begin();
+}
+
+size_t PageCache::FindSpanList(size_t k) const
+{
+	// 第一个字里把小于k的位去掉，之后的字整字判断
+	size_t w = k / 64;
+	uint64_t bits = _nonempty[w] & (~(uint64_t)0 << (k % 64));
+	while (bits == 0)
+	{
+		if (++w == BITMAP_WORDS)
+			return 0;
+		bits = _nonempty[w];
+	}
+
+	return w * 64 + CountTrailingZeros(bits);
+}
+
+bool PageCache::EnsureMap(PAGE_ID start, size_t n)
+{
+	std::unique_lock<std::mutex> lock(map_mtx);
+	return _id_span_map.Ensure(start, n);
+}
+
+Span* PageCache::NewLargeSpan(size_t k, size_t align_pages)
+{
+	assert(k > NUM_PAGE - 1 || align_pages > 1);
+
+	Span* span = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(_large_mtx);
+		span = TakeCachedLargeSpan(k, align_pages);
+	}
+
+	// 缓存里没有合适的，才向系统申请
+	if (span == nullptr)
+	{
+		void* ptr = SystemAllocOnNode(k, align_pages);
+		_mapped_pages += k;
 
-		// 建立id与span的映射，在Central Cache回收小块内存时，查找对应的span
-		for (PAGE_ID i = 0; i < need_span->_page_num; ++i)
 		{
-			_id_span_map.set(need_span->_page_id + i, need_span);
+			std::unique_lock<std::mutex> lock(_large_mtx);
+			span = NewLargeSpanObject();
 		}
+		span->_page_id = (PAGE_ID)ptr >> PAGE_SHIFT;
+		span->_page_num = k;
+	}
+
+	if (!EnsureMap(span->_page_id, span->_page_num))
+		throw std::bad_alloc();
+
+	// 大对象只会通过首页找到span，再映射尾页供相邻span合并时判断（看到_is_use就不会合并）
+	_id_span_map.set(span->_page_id, span);
+	_id_span_map.set(span->_page_id + span->_page_num - 1, span);
+
+	return span;
+}
+
+void PageCache::ReleaseLargeSpan(Span* span)
+{
+	// 首尾页的映射都要清掉，否则之后合并时会查到已经回收的span
+	_id_span_map.set(span->_page_id, nullptr);
+	_id_span_map.set(span->_page_id + span->_page_num - 1, nullptr);
+
+	SpanList evicted;
+	{
+		std::unique_lock<std::mutex> lock(_large_mtx);
+		InsertCachedLargeSpan(span);
+		TrimLargeCache(evicted);
+	}
+
+	FreeEvictedLargeSpans(evicted);
+}
+
+void PageCache::SetLargeCacheLimit(size_t bytes)
+{
+	SpanList evicted;
+	{
+		std::unique_lock<std::mutex> lock(_large_mtx);
+		_large_cache_limit = bytes >> PAGE_SHIFT;
+		TrimLargeCache(evicted);
 	}
 
-	// 检查后面的桶里有没有span(比k大)，如果有将其切分
-	for (size_t i = k + 1; i < NUM_PAGE; ++i)
+	FreeEvictedLargeSpans(evicted);
+}
+
+Span* PageCache::TakeCachedLargeSpan(size_t k, size_t align_pages)
+{
+	// best-fit：按页数从小到大，第一个能切出对齐的k页的span，页数相同取地址低的
+	Span* best = nullptr;
+	PAGE_ID best_id = 0;
+	for (auto it = _large_by_size.lower_bound(k); it != _large_by_size.end(); ++it)
 	{
-		if (!_span_lists[i].Empty())
+		Span* span = *it;
+		PAGE_ID aligned_id = (span->_page_id + align_pages - 1) & ~(PAGE_ID)(align_pages - 1);
+		if (aligned_id + k > span->_page_id + span->_page_num)
+			continue;
+
+#ifdef _WIN32
+		// VirtualFree只能整块释放，缓存里的span不切分，多出来不超过1/8才整个交出去
+		if (span->_page_num - k > k / 8)
+			break;
+		if (aligned_id != span->_page_id)
+			continue;
+#endif
+
+		best = span;
+		best_id = aligned_id;
+		break;
+	}
+
+	if (best == nullptr)
+	{
+		return nullptr;
+	}
+
+	UnlinkCachedLargeSpan(best);
+	_large_cached_pages -= best->_page_num;
+
+#ifndef _WIN32
+	// 切成 head: [page_id, best_id)  need: [best_id, best_id + k)  tail: 剩下的部分
+	// head和tail留在缓存里，need交出去之后还回来时会与它们重新合并
+	size_t head_num = (size_t)(best_id - best->_page_id);
+	size_t tail_num = best->_page_num - head_num - k;
+
+	if (head_num > 0)
+	{
+		Span* head = NewLargeSpanObject();
+		head->_page_id = best->_page_id;
+		head->_page_num = head_num;
+		InsertCachedLargeSpan(head);
+	}
+
+	if (tail_num > 0)
+	{
+		Span* tail = NewLargeSpanObject();
+		tail->_page_id = best_id + k;
+		tail->_page_num = tail_num;
+		InsertCachedLargeSpan(tail);
+	}
+
+	best->_page_id = best_id;
+	best->_page_num = k;
+#endif
+
+	return best;
+}
+
+void PageCache::InsertCachedLargeSpan(Span* span)
+{
+	_large_cached_pages += span->_page_num;
+
+#ifndef _WIN32
+	// 地址相邻的span合并成一个（munmap可以跨越多次mmap得到的区间）
+	// 索引按页号/页数排序，修改之前先摘下来
+	auto next = _large_by_address.lower_bound(span->_page_id);
+	if (next != _large_by_address.begin())
+	{
+		Span* prev = *std::prev(next);
+		if (prev->_page_id + prev->_page_num == span->_page_id)
 		{
-			Span* cleaved_span = _span_lists[i].PopFront();
-			//Span* need_span = new Span;
-			Span* need_span = _span_pool.New();
+			UnlinkCachedLargeSpan(prev);
+			prev->_page_num += span->_page_num;
+			_large_span_pool.Delete(span);
+			span = prev;
+		}
+	}
 
-			// 在cleaved_span的头部切一个k页下来
-			// k页返回
-			// cleaved_span挂到对应映射的位置
-			need_span->_page_id = cleaved_span->_page_id;
-			need_span->_page_num = k;
+	if (next != _large_by_address.end() && span->_page_id + span->_page_num == (*next)->_page_id)
+	{
+		Span* after = *next;
+		UnlinkCachedLargeSpan(after);
+		span->_page_num += after->_page_num;
+		_large_span_pool.Delete(after);
+	}
+#endif
 
-			cleaved_span->_page_id += k;
-			cleaved_span->_page_num -= k;
+	_large_by_size.insert(span);
+	_large_by_address.insert(span);
+}
 
-			_span_lists[cleaved_span->_page_num].PushFront(cleaved_span);
+void PageCache::UnlinkCachedLargeSpan(Span* span)
+{
+	_large_by_size.erase(span);
+	_large_by_address.erase(span);
+}
 
-			// 存储cleaved_span的首尾页号与cleaved_span映射
-			// 方便PageCache回收内存时，进行的合并查找
-			//_id_span_map[cleaved_span->_page_id] = cleaved_span;
-			//_id_span_map[cleaved_span->_page_id + cleaved_span->_page_num - 1] = cleaved_span;
-			_id_span_map.set(cleaved_span->_page_id, cleaved_span);
-			_id_span_map.set(cleaved_span->_page_id + cleaved_span->_page_num - 1, cleaved_span);
+size_t PageCache::EvictCachedLargeSpans(size_t max_pages, SpanList& evicted)
+{
+	size_t pages = 0;
+	while (pages < max_pages && !_large_by_size.empty())
+	{
+		Span* largest = *_large_by_size.rbegin();
+		UnlinkCachedLargeSpan(largest);
+		_large_cached_pages -= largest->_page_num;
+		pages += largest->_page_num;
+		evicted.PushFront(largest);
+	}
+	return pages;
+}
 
-			
-			// 建立id与审判的映射，方便CentralCache回收小块内存时，查找对应的span
-			//注意：need_span的每一个页面都需要注册，因为 obj的ptr-> span的_page_id -> span
-			for (PAGE_ID i = 0; i < need_span->_page_num; ++i)
-			{
-				_id_span_map.set(need_span->_page_id + i, need_span);
-			}
+void PageCache::TrimLargeCache(SpanList& evicted)
+{
+	if (_large_cached_pages > _large_cache_limit)
+	{
+		EvictCachedLargeSpans(_large_cached_pages - _large_cache_limit, evicted);
+	}
+}
+
+void PageCache::FreeEvictedLargeSpans(SpanList& evicted)
+{
+	if (evicted.Empty())
+	{
+		return;
+	}
+
+	for (Span* it = evicted.Begin(); it != evicted.End(); it = it->_next)
+	{
+		SystemFree((void*)(it->_page_id << PAGE_SHIFT), it->_page_num);
+		_mapped_pages -= it->_page_num;
+	}
+
+	// 放回池里的Span仍然保留着_is_use，其它线程合并时读到过期的指针也不会把它当成空闲span
+	std::unique_lock<std::mutex> lock(_large_mtx);
+	while (!evicted.Empty())
+	{
+		_large_span_pool.Delete(evicted.PopFront());
+	}
+}
+
+
+// 获取一个k页、起始页号按align_pages对齐的span
+// 从空闲span中切出对齐的k页，前后多出来的部分作为新的空闲span挂回去
+Span* PageCache::NewAlignedSpan(size_t k, size_t align_pages)
+{
+	assert(k > 0);
+	assert((align_pages & (align_pages - 1)) == 0);
+
+	if (align_pages <= 1)
+	{
+		return NewSpan(k);
+	}
 
-			return need_span;
+	// 至少k + align_pages - 1页的span中一定能切出对齐的k页
+	// 超过128页管理不了，直接向系统要对齐的空间
+	size_t need = k + align_pages - 1;
+	if (need > NUM_PAGE - 1)
+	{
+		if (k > NUM_PAGE - 1)
+		{
+			return NewLargeSpan(k, align_pages);
+		}
+
+		Span* span = NewSystemSpan(k, align_pages);
+		for (PAGE_ID i = 0; i < span->_page_num; ++i)
+		{
+			_id_span_map.set(span->_page_id + i, span);
 		}
+
+		span->_is_use = true;
+		return span;
 	}
 
-	// 走到这个位置了，就说明后面没有大页的span了
-	// 这时，向堆要一个128页的span
-	//Span* big_span = new Span;
-	Span* big_span = _span_pool.New();
-	void* ptr = SystemAlloc(NUM_PAGE - 1);
-	big_span->_page_id = (PAGE_ID)ptr >> PAGE_SHIFT;
-	big_span->_page_num = NUM_PAGE - 1;
+	Span* span = nullptr;
+	size_t i = FindSpanList(need);
+	if (i != 0)
+	{
+		span = FirstSpan(i);
+		EraseSpan(span);
+	}
+	else
+	{
+		// 与NewSpan一样，放锁向系统要一个128页的span，直接从中切
+		span = NewSystemSpan(NUM_PAGE - 1);
+	}
+
+	// span: [page_id, page_id + page_num)
+	// 切成 head: [page_id, aligned_id)  need: [aligned_id, aligned_id + k)  tail: 剩下的部分
+	PAGE_ID aligned_id = (span->_page_id + align_pages - 1) & ~(PAGE_ID)(align_pages - 1);
+	size_t head_num = (size_t)(aligned_id - span->_page_id);
+	size_t tail_num = span->_page_num - head_num - k;
+
+	if (head_num > 0)
+	{
+		Span* head = NewSpanObject();
+		head->_page_id = span->_page_id;
+		head->_page_num = head_num;
+		head->_is_returned = span->_is_returned;
+
+		PushSpan(head);
+		_id_span_map.set(head->_page_id, head);
+		_id_span_map.set(head->_page_id + head->_page_num - 1, head);
+	}
+
+	if (tail_num > 0)
+	{
+		Span* tail = NewSpanObject();
+		tail->_page_id = aligned_id + k;
+		tail->_page_num = tail_num;
+		tail->_is_returned = span->_is_returned;
+
+		PushSpan(tail);
+		_id_span_map.set(tail->_page_id, tail);
+		_id_span_map.set(tail->_page_id + tail->_page_num - 1, tail);
+	}
 
-	_span_lists[big_span->_page_num].PushFront(big_span);
+	span->_page_id = aligned_id;
+	span->_page_num = k;
+	CommitSpan(span);
 
-	// 现在有128页span了，递归调用该函数
-	return NewSpan(k);
+	for (PAGE_ID i = 0; i < span->_page_num; ++i)
+	{
+		_id_span_map.set(span->_page_id + i, span);
+	}
+
+	span->_is_use = true;
+	return span;
 }
 
+bool PageCache::ResizeSpan(Span* span, size_t new_pages)
+{
+	assert(span->_is_use);
+	assert(new_pages > 0);
+
+	size_t old_pages = span->_page_num;
+	if (new_pages == old_pages)
+	{
+		return true;
+	}
+
+	// 超过128页的span是单独向系统申请的
+	if (old_pages > NUM_PAGE - 1)
+	{
+		return ResizeLargeSpan(span, new_pages);
+	}
+
+	if (new_pages > NUM_PAGE - 1)
+	{
+		return false;
+	}
+
+	if (new_pages < old_pages)
+	{
+		// 尾部切成一个span，按正常释放的流程还回来，顺便与后面的空闲span合并
+		Span* tail = NewSpanObject();
+		tail->_page_id = span->_page_id + new_pages;
+		tail->_page_num = old_pages - new_pages;
+		tail->_is_use = true;
+		span->_page_num = new_pages;
+
+		ReleaseSpanToPage(tail);
+		return true;
+	}
+
+	// 紧挨着的下一个span空闲且够大时才能原地扩大
+	// 合并之后被吸收的span首页的映射不会清掉，查到的span必须真的从这一页开始，否则是过期的映射
+	size_t extra = new_pages - old_pages;
+	PAGE_ID next_id = span->_page_id + old_pages;
+	Span* next_span = (Span*)_id_span_map.get(next_id);
+	if (next_span == nullptr || next_span->_node != _node || next_span->_page_id != next_id
+		|| next_span->_is_use || next_span->_page_num < extra)
+	{
+		return false;
+	}
+
+	EraseSpan(next_span);
+
+	// 只拿需要的页，剩下的继续空闲
+	if (next_span->_page_num > extra)
+	{
+		Span* rest = NewSpanObject();
+		rest->_page_id = next_span->_page_id + extra;
+		rest->_page_num = next_span->_page_num - extra;
+		rest->_is_returned = next_span->_is_returned;
+
+		PushSpan(rest);
+		_id_span_map.set(rest->_page_id, rest);
+		_id_span_map.set(rest->_page_id + rest->_page_num - 1, rest);
+
+		next_span->_page_num = extra;
+	}
+
+	CommitSpan(next_span);
+	for (PAGE_ID i = 0; i < extra; ++i)
+	{
+		_id_span_map.set(next_span->_page_id + i, span);
+	}
+	_span_pool.Delete(next_span);
+
+	span->_page_num = new_pages;
+	return true;
+}
+
+bool PageCache::ResizeLargeSpan(Span* span, size_t new_pages)
+{
+	assert(span->_page_num > NUM_PAGE - 1);
+
+	size_t old_pages = span->_page_num;
+	if (new_pages <= NUM_PAGE - 1)
+		return false;
+
+	void* ptr = SystemRemap((void*)(span->_page_id << PAGE_SHIFT), old_pages, new_pages);
+	if (ptr == nullptr)
+		return false;
+	_mapped_pages += new_pages;
+	_mapped_pages -= old_pages;
+
+	PAGE_ID new_id = (PAGE_ID)ptr >> PAGE_SHIFT;
+	if (!EnsureMap(new_id, new_pages))
+		throw std::bad_alloc();
+
+	_id_span_map.set(span->_page_id, nullptr);
+	_id_span_map.set(span->_page_id + old_pages - 1, nullptr);
+
+	span->_page_id = new_id;
+	span->_page_num = new_pages;
+	_id_span_map.set(span->_page_id, span);
+	_id_span_map.set(span->_page_id + new_pages - 1, span);
+
+	// 放不下时SystemRemap挪到了另外申请的一段地址上，那段地址没有绑定节点；原地扩大的尾部也一样
+	// 整段重新绑定到span所属的节点，之后缺页分配的物理页才不会离开本节点
+	if (Numa::NumNodes() > 1)
+	{
+		Numa::BindToNode(ptr, new_pages << PAGE_SHIFT, span->_node.load(std::memory_order_relaxed));
+	}
+
+	return true;
+}
 
 Span* PageCache::MapObjectToSpan(void* obj)
 {
@@ -116,9 +694,7 @@ void PageCache::ReleaseSpanToPage(Span* span)
 	// 大于128 page的直接还堆
 	if (span->_page_num > NUM_PAGE - 1)
 	{
-		void* ptr = (void*)(span->_page_id << PAGE_SHIFT);
-		SystemFree(ptr);
-
+		ReleaseLargeSpan(span);
 		return;
 	}
 
@@ -137,19 +713,30 @@ void PageCache::ReleaseSpanToPage(Span* span)
 		Span* ret = (Span*)_id_span_map.get(prev_id);
 		if (ret == nullptr) { break; }
 
-		// 前面的相邻页的span正在被使用，不合并
+		// 前面的相邻页的span属于别的节点或者正在被使用，不合并
+		// 别的节点和超过128页的span不受这把_page_mtx保护：先原子地读_node，不是本节点就不再碰它的其它字段
+		// （读到本节点时，持有本节点的锁期间它不会被改成别的节点）；大span的_is_use始终为true
 		Span* prev_span = ret;
+		if (prev_span->_node != _node) { break; }
 		if (prev_span->_is_use == true) { break; }
+		if (prev_span->_page_id + prev_span->_page_num != span->_page_id) { break; }
 
 		// 合并出超过128页的span没办法管理，不合并
 		if (span->_page_num + prev_span->_page_num > NUM_PAGE - 1) { break; }
 		
 		// 终于可以合并了
+		// prev_span已经被span合并了，先从它原有的span_list剔除（剔除时要用它原来的归还状态）
+		EraseSpan(prev_span);
+
+		// 归还状态不同的两块合并后按未归还处理，已归还的那部分需要重新提交
+		if (prev_span->_is_returned != span->_is_returned)
+		{
+			Span* returned_span = prev_span->_is_returned ? prev_span : span;
+			CommitSpan(returned_span);
+		}
+
 		span->_page_id = prev_span->_page_id;
 		span->_page_num += prev_span->_page_num;
-
-		// prev_span已经被span合并了，从它原有的span_list剔除
-		_span_lists[prev_span->_page_num].Erase(prev_span);
 		//delete prev_span;
 		_span_pool.Delete(prev_span);
 	}
@@ -164,21 +751,28 @@ void PageCache::ReleaseSpanToPage(Span* span)
 		if (ret == nullptr) { break; }
 
 		Span* next_span = ret;
+		if (next_span->_node != _node) { break; }
 		if (next_span->_is_use == true) { break; }
+		if (next_span->_page_id != next_id) { break; }
 
 		// 合并出超过128页的span没办法管理，不合并
 		if (span->_page_num + next_span->_page_num > NUM_PAGE - 1) { break; }
 
 		// 终于可以合并了
-		span->_page_num += next_span->_page_num;
+		EraseSpan(next_span);
 
-		// prev_span已经被span合并了，从它原有的span_list剔除
-		_span_lists[next_span->_page_num].Erase(next_span);
+		if (next_span->_is_returned != span->_is_returned)
+		{
+			Span* returned_span = next_span->_is_returned ? next_span : span;
+			CommitSpan(returned_span);
+		}
+
+		span->_page_num += next_span->_page_num;
 		//delete next_span;
 		_span_pool.Delete(next_span);
 	}
 
-	_span_lists[span->_page_num].PushFront(span);
+	PushSpan(span);
 	span->_is_use = false;
 
 	// 注册新span到_id_span_map 中，以便它与其它span融合
@@ -186,4 +780,169 @@ void PageCache::ReleaseSpanToPage(Span* span)
 	//_id_span_map[span->_page_id + span->_page_num - 1] = span;
 	_id_span_map.set(span->_page_id, span);
 	_id_span_map.set(span->_page_id + span->_page_num - 1, span);
-}
\ No newline at end of file
+}
+
+void PageCache::CommitSpan(Span* span)
+{
+	if (span->_is_returned)
+	{
+		SystemCommit((void*)(span->_page_id << PAGE_SHIFT), span->_page_num);
+		span->_is_returned = false;
+	}
+}
+
+size_t PageCache::ReleaseFreePages(size_t max_pages)
+{
+	size_t released = 0;
+
+	// 从大到小遍历，每个桶从尾部开始：PushFront进来的span在头部，尾部是闲置最久的
+	// _span_lists里只有物理页还在的span，归还之后挂到_returned_lists，下次不会再扫到
+	for (size_t i = NUM_PAGE - 1; i > 0 && released < max_pages; --i)
+	{
+		SpanList& list = _span_lists[i];
+		while (!list.Empty() && released < max_pages)
+		{
+			Span* span = list.End()->_prev;
+			EraseSpan(span);
+
+			SystemRelease((void*)(span->_page_id << PAGE_SHIFT), span->_page_num, _release_lazy);
+			span->_is_returned = true;
+			released += span->_page_num;
+
+			PushSpan(span);
+		}
+	}
+
+	// 大对象缓存里的span整个还给系统，从最大的开始（_page_mtx之后拿_large_mtx，与NewAlignedSpan的顺序相同）
+	if (released < max_pages)
+	{
+		SpanList evicted;
+		{
+			std::unique_lock<std::mutex> lock(_large_mtx);
+			released += EvictCachedLargeSpans(max_pages - released, evicted);
+		}
+		FreeEvictedLargeSpans(evicted);
+	}
+
+	return released;
+}
+
+size_t PageCache::ReleaseFreeMemory()
+{
+	size_t released = 0;
+	for (size_t node = 0; node < Numa::NumNodes(); ++node)
+	{
+		CentralCache::GetInstance(node)->Plunder(true);
+
+		PageCache* page_cache = GetInstance(node);
+		page_cache->_page_mtx.lock();
+		released += page_cache->ReleaseFreePages(SIZE_MAX);
+		page_cache->_page_mtx.unlock();
+	}
+	return released;
+}
+
+void PageCache::CollectStats(MallocStats& stats)
+{
+	std::unique_lock<std::mutex> lock(_page_mtx);
+
+	size_t free_pages = 0;
+	size_t returned_pages = 0;
+	for (size_t i = 1; i < NUM_PAGE; ++i)
+	{
+		for (Span* it = _span_lists[i].Begin(); it != _span_lists[i].End(); it = it->_next)
+		{
+			free_pages += it->_page_num;
+		}
+		for (Span* it = _returned_lists[i].Begin(); it != _returned_lists[i].End(); it = it->_next)
+		{
+			free_pages += it->_page_num;
+			returned_pages += it->_page_num;
+		}
+	}
+
+	// 多个节点的数据累加在一起，大对象占用的页在所有节点都统计完之后再算（见ConcurrentGetStats）
+	stats._mapped_bytes += (size_t)_mapped_pages << PAGE_SHIFT;
+	stats._page_cache_bytes += (free_pages - returned_pages) << PAGE_SHIFT;
+	stats._released_bytes += returned_pages << PAGE_SHIFT;
+	stats._large_alloc_count += _large_alloc_count;
+	stats._large_free_count += _large_free_count;
+
+	lock.unlock();
+
+	std::unique_lock<std::mutex> large_lock(_large_mtx);
+	stats._large_cache_bytes += _large_cached_pages << PAGE_SHIFT;
+}
+
+void PageCache::SetReleaseRate(size_t bytes_per_second, bool lazy)
+{
+	std::unique_lock<std::mutex> lock(_scavenger_mtx);
+	_release_rate = bytes_per_second;
+	_release_lazy = lazy;
+
+	if (bytes_per_second > 0 && !_scavenger.joinable())
+	{
+		_scavenger = std::thread(&PageCache::ScavengerLoop, this);
+	}
+
+	_scavenger_cv.notify_one();
+}
+
+void PageCache::ScavengerLoop()
+{
+	// 每个周期归还 速率*周期 字节，不足一页的部分累积到下个周期
+	// 一次至少归还整个span，多还的部分记为负额度，从之后的周期里扣回来
+	static const std::chrono::milliseconds kInterval(100);
+	static const size_t kPlunderIntervals = 10;		// 每秒清扫一次中转缓存
+	long long credit = 0;
+	size_t intervals = 0;
+
+	// PageCache永不析构，回收线程一直运行到进程退出
+	std::unique_lock<std::mutex> lock(_scavenger_mtx);
+	while (true)
+	{
+		_scavenger_cv.wait_for(lock, kInterval);
+
+		if (_release_rate == 0)
+		{
+			credit = 0;
+			continue;
+		}
+
+		// 上一秒里一直没被取走的批次还给span，空出来的span才有机会被下面归还
+		if (++intervals == kPlunderIntervals)
+		{
+			intervals = 0;
+			lock.unlock();
+			for (size_t node = 0; node < Numa::NumNodes(); ++node)
+			{
+				CentralCache::GetInstance(node)->Plunder();
+			}
+			lock.lock();
+		}
+
+		credit += (long long)(_release_rate / (std::chrono::milliseconds(1000) / kInterval));
+		if (credit < (1LL << PAGE_SHIFT))
+			continue;
+
+		size_t max_pages = (size_t)credit >> PAGE_SHIFT;
+
+		// 依次回收各个节点的空闲span
+		lock.unlock();
+		size_t released = 0;
+		for (size_t node = 0; node < Numa::NumNodes() && released < max_pages; ++node)
+		{
+			PageCache* page_cache = GetInstance(node);
+			page_cache->_page_mtx.lock();
+			released += page_cache->ReleaseFreePages(max_pages - released);
+			page_cache->_page_mtx.unlock();
+		}
+		lock.lock();
+
+		credit -= (long long)(released << PAGE_SHIFT);
+
+		// 没有更多可归还的span时不攒额度，避免之后一次性大量madvise
+		if (released < max_pages && credit > 0)
+			credit = 0;
+	}
+}
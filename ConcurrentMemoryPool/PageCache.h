@@ -3,36 +3,269 @@
 #include "Common.h"
 #include "ObjectPool.h"
 #include "PageMap.h"
+#include "Numa.h"
 
+#include <condition_variable>
+#include <set>
 
-// 单例模式（饿汉版）
+struct MallocStats;
+
+#if defined(_WIN64) || UINTPTR_MAX > 0xFFFFFFFFu
+typedef TCMalloc_PageMap3<48 - PAGE_SHIFT> SpanMap;
+#else
+typedef TCMalloc_PageMap1<32 - PAGE_SHIFT> SpanMap;
+#endif
+
+// 大对象缓存索引(std::set)的节点分配器：节点从每个NUMA节点自己的ObjectPool里取，
+// 不经过全局operator new（它可能就是内存池自己，会在持有_large_mtx时重入）
+// 同一个节点的两个索引共用一个池，只在持有该节点的_large_mtx时使用
+template<class T>
+class LargeIndexAllocator
+{
+	template<class U>
+	friend class LargeIndexAllocator;
+
+private:
+	struct alignas(T) Storage
+	{
+		unsigned char _bytes[sizeof(T)];
+	};
+
+	size_t _node;
+
+	static ObjectPool<Storage>& Pool(size_t node)
+	{
+		static ObjectPool<Storage> pools[MAX_NUMA_NODES];
+		return pools[node];
+	}
+
+public:
+	typedef T value_type;
+
+	explicit LargeIndexAllocator(size_t node) noexcept
+		: _node(node)
+	{}
+
+	template<class U>
+	LargeIndexAllocator(const LargeIndexAllocator<U>& other) noexcept
+		: _node(other._node)
+	{}
+
+	T* allocate(size_t n)
+	{
+		assert(n == 1);
+		(void)n;
+		return (T*)Pool(_node).New();
+	}
+
+	void deallocate(T* ptr, size_t) noexcept
+	{
+		Pool(_node).Delete((Storage*)ptr);
+	}
+
+	template<class U>
+	bool operator==(const LargeIndexAllocator<U>& other) const noexcept
+	{
+		return _node == other._node;
+	}
+
+	template<class U>
+	bool operator!=(const LargeIndexAllocator<U>& other) const noexcept
+	{
+		return _node != other._node;
+	}
+};
+
+// 大对象缓存按(页数, 起始页号)排序，best-fit就是lower_bound(k)之后第一个放得下的
+struct LargeSpanBySize
+{
+	typedef void is_transparent;
+
+	bool operator()(const Span* a, const Span* b) const
+	{
+		return a->_page_num != b->_page_num ? a->_page_num < b->_page_num : a->_page_id < b->_page_id;
+	}
+	bool operator()(const Span* a, size_t k) const { return a->_page_num < k; }
+	bool operator()(size_t k, const Span* b) const { return k < b->_page_num; }
+};
+
+// 按起始页号排序，放进缓存时找前后相邻的span合并
+struct LargeSpanByAddress
+{
+	typedef void is_transparent;
+
+	bool operator()(const Span* a, const Span* b) const { return a->_page_id < b->_page_id; }
+	bool operator()(const Span* a, PAGE_ID id) const { return a->_page_id < id; }
+	bool operator()(PAGE_ID id, const Span* b) const { return id < b->_page_id; }
+};
+
+// 每个NUMA节点一个实例（懒汉版，第一次使用时构造，见GetInstance），只有一个节点时就是单例
+// span记录自己属于哪个节点，释放时还给对应的实例；页号到span的映射所有节点共用一份
 class PageCache
 {
 private:
+	size_t _node;					// 所在的NUMA节点
 	SpanList _span_lists[NUM_PAGE];  // span的页数对应桶的下标
+	SpanList _returned_lists[NUM_PAGE];	// 物理页已经还给系统的空闲span单独挂，回收时不用再扫一遍
+
+	// 非空桶的位图：第i位为1表示_span_lists[i]或_returned_lists[i]不为空，与空闲链表一起受_page_mtx保护
+	// 找不小于k页的span时按位查找，不用逐个桶遍历
+	static const size_t BITMAP_WORDS = (NUM_PAGE + 63) / 64;
+	uint64_t _nonempty[BITMAP_WORDS] = { 0 };
 	ObjectPool<Span> _span_pool;
 
-	static PageCache _instance_page;
-	TCMalloc_PageMap1<32 - PAGE_SHIFT> _id_span_map;
+	SpanMap& _id_span_map;			// 所有节点共用，查找无锁，建节点(Ensure)时加锁
+
+	// 超过128页的span不进空闲链表，也不需要_page_mtx
+	// 释放后先留在大对象缓存里（相邻的合并），申请时按best-fit切出来，
+	// 缓存超过_large_cache_limit页、或者被ReleaseFreePages回收时，把最大的span还给系统
+	// 同一批span在两个索引里各有一项，查找/插入/删除都是O(log n)
+	ObjectPool<Span> _large_span_pool;
+	std::set<Span*, LargeSpanBySize, LargeIndexAllocator<Span*>> _large_by_size;
+	std::set<Span*, LargeSpanByAddress, LargeIndexAllocator<Span*>> _large_by_address;
+	size_t _large_cached_pages = 0;
+	size_t _large_cache_limit = ((size_t)64 << 20) >> PAGE_SHIFT;
+	std::mutex _large_mtx;			// 保护上面几项
+
 public:
-	std::mutex _page_mtx;			// 用一整个锁,不是不用桶锁，而是它更有性价比(效率更高)
+	// 保护空闲链表和不超过128页的span，整个节点一把锁：切分/合并一次要动好几个桶，
+	// 分桶加锁就要在每次合并时按顺序拿多把锁；向系统申请内存时会先放掉这把锁，
+	// 超过128页的span走_large_mtx，多个节点时每个节点各有一把
+	std::mutex _page_mtx;
+
+	// 大对象的申请/释放次数
+	std::atomic<uint64_t> _large_alloc_count{ 0 };
+	std::atomic<uint64_t> _large_free_count{ 0 };
 
 private:
-	PageCache() {}
+	std::atomic<size_t> _mapped_pages{ 0 };		// 向系统申请、还没有还回去的页数
+
+	// 后台回收线程：按照限定的速率把空闲span的物理页还给系统
+	std::thread _scavenger;
+	std::mutex _scavenger_mtx;
+	std::condition_variable _scavenger_cv;
+	size_t _release_rate = 0;		// 每秒最多归还的字节数，0表示不归还
+	bool _release_lazy = false;		// 使用MADV_FREE而不是MADV_DONTNEED
+
+	static std::atomic<PageCache*> _instances[MAX_NUMA_NODES];
+
+private:
+	PageCache(size_t node);
 	PageCache(const PageCache&) = delete;
 	PageCache& operator=(const PageCache&) = delete;
+
+	static PageCache* CreateInstance(size_t node);
 public:
-	static PageCache* GetInstance()
+	// 与CentralCache相同：第一次使用时构造，永不析构（后台回收线程随进程退出）
+	static PageCache* GetInstance(size_t node = 0)
 	{
-		return &_instance_page;
+		PageCache* instance = _instances[node].load(std::memory_order_acquire);
+		return instance != nullptr ? instance : CreateInstance(node);
 	}
 
-	// 返回 k页 大小的 span
+	size_t Node() const
+	{
+		return _node;
+	}
+
+	// 返回 k页 大小的 span（调用前持有_page_mtx，中途可能放锁向系统申请）
 	Span* NewSpan(size_t k);
 
+	// 超过128页（或者需要更大对齐）的span，经大对象缓存向系统申请/归还，调用时不需要持有_page_mtx
+	Span* NewLargeSpan(size_t k, size_t align_pages = 1);
+	void ReleaseLargeSpan(Span* span);
+	bool ResizeLargeSpan(Span* span, size_t new_pages);
+
+	// 设置大对象缓存的上限(字节)，0表示不缓存，超出的部分立即还给系统
+	void SetLargeCacheLimit(size_t bytes);
+
+	// 返回 k页 大小、起始页号是 align_pages 整数倍的 span
+	Span* NewAlignedSpan(size_t k, size_t align_pages);
+
+	// 把正在使用的大对象span原地调整为new_pages页，成功返回true（超过128页的span起始页可能改变）
+	//	缩小：尾部多出来的页还给PageCache
+	//	扩大：占用紧挨着的空闲span；超过128页的span用mremap
+	bool ResizeSpan(Span* span, size_t new_pages);
+
 	// 获取从内存对象到span的映射
 	Span* MapObjectToSpan(void* obj);
 
 	// 释放空闲span到PageCache，并尝试合并相邻的span
 	void ReleaseSpanToPage(Span* span);
+
+	// 把最多max_pages页空闲span的物理页还给系统，返回实际归还的页数
+	// 与NewSpan等一样，调用前需要持有_page_mtx
+	// 空闲链表上的span只归还物理页(madvise)，不够max_pages时再把大对象缓存里最大的span整个还给系统(munmap)
+	// 中转缓存里闲置的对象要先经过CentralCache::Plunder回到span，span空出来才会进PageCache；
+	// Plunder要拿_page_mtx，所以由调用方在加锁之前做（见ScavengerLoop、ReleaseFreeMemory）
+	size_t ReleaseFreePages(size_t max_pages);
+
+	// 清空所有节点的中转缓存，再把所有节点空闲span的物理页都还给系统，返回归还的页数
+	static size_t ReleaseFreeMemory();
+
+	// 设置后台回收速率(字节/秒)，第一次设置非0值时启动后台线程，设置为0则暂停回收
+	// lazy为true时使用MADV_FREE，否则使用MADV_DONTNEED
+	// 只在节点0的实例上设置，回收线程依次回收所有节点的空闲span
+	void SetReleaseRate(size_t bytes_per_second, bool lazy = false);
+
+	// 把本节点空闲span、已归还和向系统申请的字节数，以及大对象的计数累加到stats（内部加锁）
+	void CollectStats(MallocStats& stats);
+
+private:
+	// span被NewSpan交出去之前，重新提交已经归还给系统的页
+	void CommitSpan(Span* span);
+
+	// 向系统申请kpage页，并绑定到本节点
+	void* SystemAllocOnNode(size_t kpage, size_t align_pages = 1);
+
+	// 放掉_page_mtx向系统申请kpage页，返回时重新持有_page_mtx
+	void* SystemAllocUnlocked(size_t kpage, size_t align_pages = 1);
+
+	// 从_span_pool/_large_span_pool取一个属于本节点的Span（后者调用前持有_large_mtx）
+	Span* NewSpanObject();
+	Span* NewLargeSpanObject();
+
+	// 本节点没有空闲span时，按NumaStealPolicy从其它节点的空闲链表切k页过来，没有返回nullptr
+	Span* StealSpan(size_t k);
+
+	// 向系统申请kpage页，包装成还没有挂进空闲链表的span（已建好基数树节点）
+	Span* NewSystemSpan(size_t kpage, size_t align_pages = 1);
+
+	// 从span头部切下k页交出去，剩下的部分挂回空闲链表
+	Span* CarveSpan(Span* span, size_t k);
+
+	// 空闲链表的进出都经过这几个函数，按_is_returned挂到对应的链表，顺带维护_nonempty
+	// span挂在链表上时不能修改_is_returned，要先EraseSpan
+	void PushSpan(Span* span);
+	void EraseSpan(Span* span);
+
+	// 第i个桶里优先交出去的span：先用物理页还在的，没有再用已经归还的
+	Span* FirstSpan(size_t i);
+
+	// 不小于k页的最小非空桶的下标，没有则返回0
+	size_t FindSpanList(size_t k) const;
+
+	bool EnsureMap(PAGE_ID start, size_t n);
+
+	// 以下调用前持有_large_mtx
+	// 从大对象缓存中按best-fit取出起始页号按align_pages对齐的k页，没有合适的返回nullptr
+	Span* TakeCachedLargeSpan(size_t k, size_t align_pages);
+	// 放进大对象缓存，与前后相邻的span合并
+	void InsertCachedLargeSpan(Span* span);
+	// 从两个索引里摘掉span，不修改_large_cached_pages
+	void UnlinkCachedLargeSpan(Span* span);
+	// 从最大的开始把span摘到evicted里，直到摘够max_pages页或者缓存空了，返回摘下的页数
+	size_t EvictCachedLargeSpans(size_t max_pages, SpanList& evicted);
+	// 缓存超过上限时，把最大的span摘到evicted里，放锁后再还给系统
+	void TrimLargeCache(SpanList& evicted);
+	// 还给系统evicted里的span（不持有_large_mtx）
+	void FreeEvictedLargeSpans(SpanList& evicted);
+
+	void ScavengerLoop();
 };
+
+// 把闲置在中转缓存和PageCache里的内存尽量还给系统，返回归还的字节数（ThreadCache里缓存的对象不动）
+inline size_t ConcurrentReleaseFreeMemory()
+{
+	return PageCache::ReleaseFreeMemory() << PAGE_SHIFT;
+}
@@ -8,6 +8,10 @@
 //
 
 #include "Common.h"
+#include "ObjectPool.h"
+
+// 三种基数树的值都是std::atomic<void*>：get不加锁，与其它线程的set（持有各自节点的_page_mtx/_large_mtx）并发
+// set用release写入、get用acquire读取，读到一个span指针时，写入之前对span的初始化一定已经可见
 
 // Single-level array
 template <int BITS>
@@ -15,7 +19,7 @@ class TCMalloc_PageMap1
 {
 private:
 	static const int LENGTH = 1 << BITS;
-	void** array_;
+	std::atomic<void*>* array_;
 
 public:
 	typedef uintptr_t Number;
@@ -24,8 +28,8 @@ public:
 	{
 		size_t size = sizeof(void*) << BITS;
 		size_t align_size = SizeClass::_RoundUp(size, 1 << PAGE_SHIFT);
-		array_ = (void**)SystemAlloc(align_size >> PAGE_SHIFT);
-		memset(array_, 0, sizeof(void*) << BITS);
+		array_ = (std::atomic<void*>*)SystemAlloc(align_size >> PAGE_SHIFT);
+		memset((void*)array_, 0, sizeof(void*) << BITS);
 	}
 
 	// Return the current value for KEY.  Returns NULL if not yet set,
@@ -36,12 +40,19 @@ public:
 		{
 			return nullptr;
 		}
-		return array_[k];
+		return array_[k].load(std::memory_order_acquire);
 	}
 
 	void set(Number k, void* v)
 	{
-		array_[k] = v;
+		assert((k >> BITS) == 0);
+		array_[k].store(v, std::memory_order_release);
+	}
+
+	// 单层数组已经全部分配，只需检查范围
+	bool Ensure(Number start, size_t n)
+	{
+		return ((start + n - 1) >> BITS) == 0;
 	}
 };
 
@@ -60,7 +71,7 @@ private:
 	// Leaf node
 	struct Leaf
 	{
-		void* values[LEAF_LENGTH];
+		std::atomic<void*> values[LEAF_LENGTH];
 	};
 
 	Leaf* root_[ROOT_LENGTH];      // Pointer to 32 child nodes
@@ -82,15 +93,15 @@ public:
 		if ((k >> BITS) > 0 || root_[i1] == NULL) {
 			return NULL;
 		}
-		return root_[i1]->values[i2];
+		return root_[i1]->values[i2].load(std::memory_order_acquire);
 	}
 
 	void set(Number k, void* v) 
 	{
 		const Number i1 = k >> LEAF_BITS;
 		const Number i2 = k & (LEAF_LENGTH - 1);
-		ASSERT(i1 < ROOT_LENGTH);
-		root_[i1]->values[i2] = v;
+		assert(i1 < ROOT_LENGTH);
+		root_[i1]->values[i2].store(v, std::memory_order_release);
 	}
 
 	bool Ensure(Number start, size_t n) 
@@ -111,7 +122,7 @@ public:
 				static ObjectPool<Leaf>	leafPool;
 				Leaf* leaf = (Leaf*)leafPool.New();
 
-				memset(leaf, 0, sizeof(*leaf));
+				memset((void*)leaf, 0, sizeof(*leaf));
 				root_[i1] = leaf;
 			}
 
@@ -126,4 +137,139 @@ public:
 		// Allocate enough to keep track of all possible pages
 		Ensure(0, 1 << BITS);
 	}
-};
\ No newline at end of file
+};
+
+// Three-level radix tree
+// 64位下用户态地址只有48位有效，页号有 48 - PAGE_SHIFT 位
+// 单层数组/两层基数树都需要预先分配全部叶子，这里改为按需创建中间节点和叶子
+// 元数据只随实际使用的堆增长，查找依旧是固定的三次访存
+//
+// get不加锁，Ensure可能同时在挂新节点：中间节点的指针用release写入、acquire读取，
+// 读到非空指针时，节点的初始化（清零）一定已经可见
+template <int BITS>
+class TCMalloc_PageMap3
+{
+private:
+	// How many bits should we consume at each interior level
+	static const int INTERIOR_BITS = (BITS + 2) / 3; // Round-up
+	static const int INTERIOR_LENGTH = 1 << INTERIOR_BITS;
+
+	// How many bits should we consume at leaf level
+	static const int LEAF_BITS = BITS - 2 * INTERIOR_BITS;
+	static const int LEAF_LENGTH = 1 << LEAF_BITS;
+
+	// Interior node：第二层指向Node，第三层指向Leaf
+	struct Node
+	{
+		std::atomic<void*> ptrs[INTERIOR_LENGTH];
+	};
+
+	// Leaf node
+	struct Leaf
+	{
+		std::atomic<void*> values[LEAF_LENGTH];
+	};
+
+	Node* root_;                          // Root of radix tree
+	size_t metadata_bytes_ = 0;           // 已经创建的节点占用的字节数
+
+	// 节点直接从ObjectPool（SystemAlloc）获取，不能走ConcurrentAlloc，否则会递归到自己
+	// New()值初始化，节点内容全部为零
+	Node* NewNode()
+	{
+		static ObjectPool<Node> nodePool;
+		metadata_bytes_ += sizeof(Node);
+		return nodePool.New();
+	}
+
+	Leaf* NewLeaf()
+	{
+		static ObjectPool<Leaf> leafPool;
+		metadata_bytes_ += sizeof(Leaf);
+		return leafPool.New();
+	}
+
+	// k所在的叶子，路径上的节点还没有创建时返回nullptr
+	Leaf* FindLeaf(uintptr_t k) const
+	{
+		const uintptr_t i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+		const uintptr_t i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+		Node* n = static_cast<Node*>(root_->ptrs[i1].load(std::memory_order_acquire));
+		if (n == nullptr)
+		{
+			return nullptr;
+		}
+		return static_cast<Leaf*>(n->ptrs[i2].load(std::memory_order_acquire));
+	}
+
+public:
+	typedef uintptr_t Number;
+
+	explicit TCMalloc_PageMap3()
+	{
+		root_ = NewNode();
+	}
+
+	// 无锁读：节点一旦挂上去就不会再被释放，值为nullptr说明这一页不属于内存池
+	void* get(Number k) const
+	{
+		if ((k >> BITS) > 0)
+		{
+			return nullptr;
+		}
+		Leaf* leaf = FindLeaf(k);
+		if (leaf == nullptr)
+		{
+			return nullptr;
+		}
+		return leaf->values[k & (LEAF_LENGTH - 1)].load(std::memory_order_acquire);
+	}
+
+	// 调用前必须先Ensure过这一页
+	void set(Number k, void* v)
+	{
+		assert((k >> BITS) == 0);
+		Leaf* leaf = FindLeaf(k);
+		assert(leaf != nullptr);
+		leaf->values[k & (LEAF_LENGTH - 1)].store(v, std::memory_order_release);
+	}
+
+	// 保证[start, start + n)这些页号的路径上的节点都已经创建
+	// 多个线程同时Ensure时由调用方加锁，与get之间不需要锁
+	bool Ensure(Number start, size_t n)
+	{
+		for (Number key = start; key <= start + n - 1;)
+		{
+			const Number i1 = key >> (LEAF_BITS + INTERIOR_BITS);
+			const Number i2 = (key >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+
+			// Check for overflow
+			if (i1 >= INTERIOR_LENGTH || i2 >= INTERIOR_LENGTH)
+				return false;
+
+			// Make 2nd level node if necessary
+			Node* node = static_cast<Node*>(root_->ptrs[i1].load(std::memory_order_relaxed));
+			if (node == nullptr)
+			{
+				node = NewNode();
+				root_->ptrs[i1].store(node, std::memory_order_release);
+			}
+
+			// Make leaf node if necessary
+			if (node->ptrs[i2].load(std::memory_order_relaxed) == nullptr)
+			{
+				node->ptrs[i2].store(NewLeaf(), std::memory_order_release);
+			}
+
+			// Advance key past whatever is covered by this leaf node
+			key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
+		}
+		return true;
+	}
+
+	// 中间节点和叶子一共占用的字节数
+	size_t MetadataBytes() const
+	{
+		return metadata_bytes_;
+	}
+};
@@ -0,0 +1,147 @@
+﻿#include "PerCpuCache.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+	#include <sys/rseq.h>
+	#define CMP_HAVE_RSEQ 1
+#endif
+#endif
+
+PerCpuCache PerCpuCache::_instance_percpu;
+std::atomic<bool> PerCpuCache::_enabled(false);
+
+int PerCpuCache::CurrentCpu()
+{
+#ifdef CMP_HAVE_RSEQ
+	// glibc 2.35起会为每个线程注册rseq区域，__rseq_size为0表示注册失败
+	if (__rseq_size == 0)
+		return -1;
+
+	const volatile struct rseq* rs =
+		(const struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+	int cpu = (int)rs->cpu_id;
+	return cpu < 0 ? -1 : cpu;
+#else
+	return -1;
+#endif
+}
+
+bool PerCpuCache::Enable()
+{
+	static std::mutex mtx;
+	std::unique_lock<std::mutex> lock(mtx);
+
+	if (Enabled())
+		return true;
+
+	if (CurrentCpu() < 0)
+		return false;
+
+	PerCpuCache* inst = GetInstance();
+#ifdef _WIN32
+	inst->_num_cpus = 0;
+#else
+	long n = sysconf(_SC_NPROCESSORS_CONF);
+	inst->_num_cpus = n > 0 ? (size_t)n : 1;
+#endif
+	if (inst->_num_cpus == 0)
+		return false;
+
+	// 槽位数组直接向系统申请，不能走内存池本身
+	size_t bytes = sizeof(Slot) * inst->_num_cpus;
+	size_t kpage = SizeClass::_RoundUp(bytes, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+	Slot* slots = (Slot*)SystemAlloc(kpage);
+	for (size_t i = 0; i < inst->_num_cpus; ++i)
+	{
+		new(&slots[i]) Slot;
+	}
+
+	inst->_slots = slots;
+	_enabled.store(true, std::memory_order_release);
+
+	return true;
+}
+
+PerCpuCache::Slot* PerCpuCache::TryLock()
+{
+	int cpu = CurrentCpu();
+	if (cpu < 0)
+		return nullptr;
+
+	// 绝大多数情况下本CPU上只有当前线程在跑，一次test_and_set就能拿到
+	// 拿不到说明持有者被抢占了或者刚从这个CPU迁走，等它没有意义
+	Slot& slot = _slots[(size_t)cpu % _num_cpus];
+	if (slot._lock.test_and_set(std::memory_order_acquire))
+		return nullptr;
+
+	return &slot;
+}
+
+void PerCpuCache::Unlock(Slot& slot)
+{
+	slot._lock.clear(std::memory_order_release);
+}
+
+bool PerCpuCache::TryAllocate(size_t size, void*& ptr)
+{
+	Slot* slot = TryLock();
+	if (slot == nullptr)
+		return false;
+
+	try
+	{
+		ptr = slot->_cache.Allocate(size);
+	}
+	catch (...)
+	{
+		Unlock(*slot);
+		throw;
+	}
+	Unlock(*slot);
+
+	return true;
+}
+
+bool PerCpuCache::TryDeallocate(void* ptr, size_t size)
+{
+	Slot* slot = TryLock();
+	if (slot == nullptr)
+		return false;
+
+	slot->_cache.Deallocate(ptr, size);
+	Unlock(*slot);
+
+	return true;
+}
+
+bool PerCpuCache::TryAllocateBatch(size_t size, size_t n, void** batch)
+{
+	Slot* slot = TryLock();
+	if (slot == nullptr)
+		return false;
+
+	try
+	{
+		slot->_cache.AllocateBatch(size, n, batch);
+	}
+	catch (...)
+	{
+		Unlock(*slot);
+		throw;
+	}
+	Unlock(*slot);
+
+	return true;
+}
+
+bool PerCpuCache::TryDeallocateBatch(void** batch, size_t n, size_t size)
+{
+	Slot* slot = TryLock();
+	if (slot == nullptr)
+		return false;
+
+	slot->_cache.DeallocateBatch(batch, n, size);
+	Unlock(*slot);
+
+	return true;
+}
@@ -0,0 +1,66 @@
+﻿#pragma once
+
+#include "Common.h"
+#include "ThreadCache.h"
+
+// 每个CPU一个前端缓存，替代每个线程一个ThreadCache
+// 线程数远多于核数且大多空闲时，缓存占用的内存随核数而不是线程数增长
+//
+// 默认不启用，需要使用方显式调用Enable()开启；内核/glibc不支持rseq时Enable()返回false，继续使用TLS的ThreadCache
+// 当前线程所在的CPU从rseq(restartable sequences)区域的cpu_id字段读取，只是一次TLS访存
+// 没有写汇编的rseq临界区，而是给每个CPU槽位配一把锁，代价与行为：
+//	1. 每次申请/释放多一次带lock前缀的test_and_set和一次release写
+//	2. 持有槽位锁的线程被抢占或者迁移到别的CPU时，槽位会被占用一段时间
+//	   这时不在槽位上自旋/排队，而是不经缓存直接与CentralCache交互（线程在启用之前已经有ThreadCache的就用它），
+//	   不会把这个CPU上的其它线程拖在一起，也不会为抢过槽位的线程各留一份缓存
+//	3. 读不到cpu_id（这个线程的rseq没有注册）时同样不经缓存
+// 每个槽位内部就是一个ThreadCache，size class和FreeList批量搬运策略完全相同
+class PerCpuCache
+{
+private:
+	struct alignas(64) Slot
+	{
+		std::atomic_flag _lock = ATOMIC_FLAG_INIT;
+		ThreadCache _cache;
+	};
+
+	Slot* _slots = nullptr;
+	size_t _num_cpus = 0;
+
+	static PerCpuCache _instance_percpu;
+	static std::atomic<bool> _enabled;
+
+private:
+	PerCpuCache() {}
+	PerCpuCache(const PerCpuCache&) = delete;
+	PerCpuCache& operator=(const PerCpuCache&) = delete;
+
+	// 只试一次：拿不到当前CPU的槽位时返回nullptr
+	Slot* TryLock();
+	void Unlock(Slot& slot);
+
+public:
+	static PerCpuCache* GetInstance()
+	{
+		return &_instance_percpu;
+	}
+
+	// 是否启用了per-CPU前端，分配和释放的快路径上每次都会检查
+	static bool Enabled()
+	{
+		return _enabled.load(std::memory_order_acquire);
+	}
+
+	// 启用per-CPU前端，rseq不可用时返回false（继续使用ThreadCache）
+	// 启用前后申请的对象可以混着释放，两种前端都从同一个CentralCache批量获取/归还
+	static bool Enable();
+
+	// 当前线程所在的CPU编号，不可用时返回-1
+	static int CurrentCpu();
+
+	// 在当前CPU的槽位上申请/释放，槽位被占用或者读不到CPU时返回false，由调用方不经缓存完成
+	bool TryAllocate(size_t size, void*& ptr);
+	bool TryDeallocate(void* ptr, size_t size);
+	bool TryAllocateBatch(size_t size, size_t n, void** batch);
+	bool TryDeallocateBatch(void** batch, size_t n, size_t size);
+};
@@ -1,5 +1,275 @@
 ﻿#include "ThreadCache.h"
 #include "CentralCache.h"
+#include "PageCache.h"
+#include "ObjectPool.h"
+#include "MallocStats.h"
+#include "HeapProfiler.h"
+
+// 所有线程共用一个ThreadCache对象池，线程创建/退出时才会访问，用一把锁保护即可
+static ObjectPool<ThreadCache> tc_pool;
+static std::mutex tc_pool_mtx;
+
+// 存活的ThreadCache链表，以及已经析构的ThreadCache累计下来的计数
+// 没有ThreadCache时(AllocateNoCache/DeallocateNoCache)的计数也记在retired_stats上
+static ThreadCache* tc_list = nullptr;
+static FreeListStats retired_stats[NUM_FREELIST];
+static std::mutex tc_list_mtx;
+
+// 全局预算中还没有分给任何ThreadCache的部分，调低预算之后可能是负数
+// 下一个被偷的ThreadCache，按链表轮流偷
+// 都由tc_list_mtx保护
+static size_t overall_budget = ThreadCache::DEFAULT_OVERALL_BYTES;
+static long long unclaimed_budget = (long long)ThreadCache::DEFAULT_OVERALL_BYTES;
+static ThreadCache* next_steal = nullptr;
+
+// thread_local对象的析构函数在线程退出时调用
+// 借助它把线程的ThreadCache中的对象还给CentralCache，并回收ThreadCache对象本身
+struct ThreadCacheRecycler
+{
+	~ThreadCacheRecycler()
+	{
+		ThreadCache* tc = Ptr_TLS_ThreadCache;
+		if (tc != nullptr)
+		{
+			// 先置空，之后本线程再有申请/释放直接找CentralCache
+			Ptr_TLS_ThreadCache = nullptr;
+			Tls_ThreadCacheRecycled = true;
+
+			std::unique_lock<std::mutex> lock(tc_pool_mtx);
+			tc_pool.Delete(tc);
+		}
+	}
+};
+
+static thread_local ThreadCacheRecycler tls_recycler;
+
+ThreadCache* ThreadCache::Create()
+{
+	ThreadCache* tc = nullptr;
+	{
+		std::unique_lock<std::mutex> lock(tc_pool_mtx);
+		tc = tc_pool.New();
+	}
+	Ptr_TLS_ThreadCache = tc;
+
+	// 访问一次tls_recycler，使其在本线程构造，线程退出时才会析构
+	// 登记析构函数时libc可能会调用calloc（内存池替换了malloc时又回到这里），
+	// 所以必须先设置好Ptr_TLS_ThreadCache，并且不能持有tc_pool_mtx
+	(void)&tls_recycler;
+
+	return tc;
+}
+
+ThreadCache::ThreadCache()
+{
+	std::unique_lock<std::mutex> lock(tc_list_mtx);
+	_next = tc_list;
+	if (tc_list != nullptr)
+	{
+		tc_list->_prev = this;
+	}
+	tc_list = this;
+
+	// 预算还有剩余时先拿一份，没有就从别的线程偷，都不行也至少给MIN_BYTES（预算暂时超支）
+	IncreaseCacheLimitLocked();
+	if (_max_size.load(std::memory_order_relaxed) == 0)
+	{
+		_max_size.store(MIN_BYTES, std::memory_order_relaxed);
+		unclaimed_budget -= (long long)MIN_BYTES;
+	}
+}
+
+void ThreadCache::IncreaseCacheLimitLocked()
+{
+	size_t max_size = _max_size.load(std::memory_order_relaxed);
+	if (unclaimed_budget > 0)
+	{
+		unclaimed_budget -= (long long)STEAL_BYTES;
+		_max_size.store(max_size + STEAL_BYTES, std::memory_order_relaxed);
+		return;
+	}
+
+	// 最多试10个，不要在锁里待太久；上限已经不超过MIN_BYTES的不偷
+	for (int i = 0; i < 10; ++i, next_steal = next_steal->_next)
+	{
+		if (next_steal == nullptr)
+		{
+			next_steal = tc_list;
+		}
+
+		size_t victim = next_steal->_max_size.load(std::memory_order_relaxed);
+		if (next_steal == this || victim <= MIN_BYTES)
+		{
+			continue;
+		}
+
+		// 被偷的一方最多降到MIN_BYTES，偷多少加多少，总预算不变
+		size_t stolen = std::min(victim - MIN_BYTES, STEAL_BYTES);
+		next_steal->_max_size.store(victim - stolen, std::memory_order_relaxed);
+		_max_size.store(max_size + stolen, std::memory_order_relaxed);
+		next_steal = next_steal->_next;
+		return;
+	}
+}
+
+void ThreadCache::SetOverallBudget(size_t bytes)
+{
+	std::unique_lock<std::mutex> lock(tc_list_mtx);
+
+	size_t claimed = 0;
+	for (ThreadCache* tc = tc_list; tc != nullptr; tc = tc->_next)
+	{
+		claimed += tc->_max_size.load(std::memory_order_relaxed);
+	}
+
+	// 已经分出去的超过新预算：按比例调低，各自在下一次释放时把多出来的还回去
+	if (claimed > bytes)
+	{
+		double ratio = (double)bytes / (double)claimed;
+		claimed = 0;
+		for (ThreadCache* tc = tc_list; tc != nullptr; tc = tc->_next)
+		{
+			size_t max_size = (size_t)(tc->_max_size.load(std::memory_order_relaxed) * ratio);
+			max_size = std::max(max_size, MIN_BYTES);
+			tc->_max_size.store(max_size, std::memory_order_relaxed);
+			claimed += max_size;
+		}
+	}
+
+	overall_budget = bytes;
+	unclaimed_budget = (long long)bytes - (long long)claimed;
+}
+
+size_t ThreadCache::OverallBudget()
+{
+	std::unique_lock<std::mutex> lock(tc_list_mtx);
+	return overall_budget;
+}
+
+void* ThreadCache::AllocateNoCache(size_t size)
+{
+	size_t index = SizeClass::Index(size);
+	size_t align_size = SizeClass::ClassSize(index);
+
+	{
+		std::unique_lock<std::mutex> lock(tc_list_mtx);
+		FreeListStats::Add(retired_stats[index]._alloc, 1);
+		FreeListStats::Add(retired_stats[index]._fetch, 1);
+		FreeListStats::Add(retired_stats[index]._requested, size);
+	}
+
+	void* start = nullptr;
+	void* end = nullptr;
+	size_t actual_num = CentralCache::GetInstance(Numa::CurrentNode())->FetchRangeObj(start, end, 1, align_size);
+	assert(actual_num == 1);
+	(void)actual_num;
+
+	return start;
+}
+
+void ThreadCache::DeallocateNoCache(void* ptr, size_t size)
+{
+	size_t index = SizeClass::Index(size);
+	{
+		std::unique_lock<std::mutex> lock(tc_list_mtx);
+		FreeListStats::Add(retired_stats[index]._free, 1);
+		FreeListStats::Add(retired_stats[index]._release, 1);
+	}
+
+	NextObj(ptr) = nullptr;
+	CentralCache::GetInstance(Numa::CurrentNode())->ReleaseListToSpans(ptr, size);
+}
+
+ThreadCache::~ThreadCache()
+{
+	for (size_t i = 0; i < NUM_FREELIST; ++i)
+	{
+		FreeList& list = _free_lists[i];
+		if (!list.Empty())
+		{
+			void* start = nullptr;
+			void* end = nullptr;
+			size_t n = list.Size();
+			list.PopRange(start, end, n);
+			FreeListStats::Add(_stats[i]._release, n);
+			_size -= n * SizeClass::ClassSize(i);
+
+			CentralCache::GetInstance(Numa::CurrentNode())->ReleaseListToSpans(start, SizeClass::ClassSize(i));
+		}
+	}
+
+	// 从链表上摘下来，上限还回全局预算，计数并入retired_stats
+	std::unique_lock<std::mutex> lock(tc_list_mtx);
+	unclaimed_budget += (long long)_max_size.load(std::memory_order_relaxed);
+	if (next_steal == this)
+	{
+		next_steal = _next;
+	}
+	if (_prev != nullptr)
+	{
+		_prev->_next = _next;
+	}
+	else
+	{
+		tc_list = _next;
+	}
+	if (_next != nullptr)
+	{
+		_next->_prev = _prev;
+	}
+
+	for (size_t i = 0; i < NUM_FREELIST; ++i)
+	{
+		FreeListStats::Add(retired_stats[i]._alloc, _stats[i]._alloc.load(std::memory_order_relaxed));
+		FreeListStats::Add(retired_stats[i]._free, _stats[i]._free.load(std::memory_order_relaxed));
+		FreeListStats::Add(retired_stats[i]._fetch, _stats[i]._fetch.load(std::memory_order_relaxed));
+		FreeListStats::Add(retired_stats[i]._release, _stats[i]._release.load(std::memory_order_relaxed));
+		FreeListStats::Add(retired_stats[i]._requested, _stats[i]._requested.load(std::memory_order_relaxed));
+	}
+}
+
+void ThreadCache::CollectStats(MallocStats& stats)
+{
+	// 先按有符号累加：跨线程释放时，单个ThreadCache的free/release可能多于alloc/fetch
+	long long live[NUM_FREELIST] = { 0 };
+	long long cached[NUM_FREELIST] = { 0 };
+
+	auto add = [&](const FreeListStats* list_stats) {
+		for (size_t i = 0; i < NUM_FREELIST; ++i)
+		{
+			const FreeListStats& s = list_stats[i];
+			uint64_t alloc = s._alloc.load(std::memory_order_relaxed);
+			uint64_t free = s._free.load(std::memory_order_relaxed);
+			uint64_t fetch = s._fetch.load(std::memory_order_relaxed);
+			uint64_t release = s._release.load(std::memory_order_relaxed);
+
+			stats._classes[i]._alloc_count += alloc;
+			stats._classes[i]._free_count += free;
+			stats._classes[i]._requested_bytes += s._requested.load(std::memory_order_relaxed);
+			live[i] += (long long)alloc - (long long)free;
+
+			// 缓存中的对象 = 拿到的 - 还回去的 - 分配出去的 + 释放回来的
+			cached[i] += (long long)fetch - (long long)release - (long long)alloc + (long long)free;
+		}
+	};
+
+	{
+		std::unique_lock<std::mutex> lock(tc_list_mtx);
+		add(retired_stats);
+		for (ThreadCache* tc = tc_list; tc != nullptr; tc = tc->_next)
+		{
+			add(tc->_stats);
+			++stats._thread_cache_count;
+		}
+	}
+
+	for (size_t i = 0; i < NUM_FREELIST; ++i)
+	{
+		stats._classes[i]._live_objects = live[i] > 0 ? (size_t)live[i] : 0;
+		stats._classes[i]._thread_cache_objects = cached[i] > 0 ? (size_t)cached[i] : 0;
+	}
+	stats._thread_cache_budget_bytes = OverallBudget();
+}
 
 
 void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
@@ -9,16 +279,13 @@ void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
 	// 2、如果不停有这个size大小的需求，batch_num会不断增长，直到上限
 	// 3、size越大，一次向central cache要的batchNum就越小
 	// 4、size越小，一次向central cache要的batchNum就越大
-	size_t batch_num = min(_free_lists[index].MaxSize(), SizeClass::NumMoveSize(size));
-	if (_free_lists[index].MaxSize() == batch_num)
-	{
-		_free_lists[index].MaxSize() += 1;
-	}
+	size_t batch_num = NextFetchNum(index);
 
 	void* start = nullptr;
 	void* end = nullptr;
-	size_t actual_num = CentralCache::GetInstance()->FetchRangeObj(start, end, batch_num, size);
+	size_t actual_num = CentralCache::GetInstance(Numa::CurrentNode())->FetchRangeObj(start, end, batch_num, size);
 	assert(actual_num > 0);
+	FreeListStats::Add(_stats[index]._fetch, actual_num);
 
 	// 如果向CentralCache申请的对象有1-bitch_num个，返回第一个，余下的挂接到_free_list
 	if (1 == actual_num)
@@ -29,26 +296,197 @@ void* ThreadCache::FetchFromCentralCache(size_t index, size_t size)
 	else
 	{
 		_free_lists[index].PushRange(NextObj(start), end, actual_num-1);
+		_size += (actual_num - 1) * SizeClass::ClassSize(index);
 		return start;
 	}
 }
 
+size_t ThreadCache::NextFetchNum(size_t index)
+{
+	FreeList& list = _free_lists[index];
+	size_t batch = SizeClass::Info(index)._batch;
+	size_t batch_num = std::min(list.MaxSize(), batch);
+
+	// 不到一批时每次+1；之后一直未命中说明这个桶很热，每次加一批，允许缓存更多
+	if (list.MaxSize() < batch)
+	{
+		list.MaxSize() += 1;
+	}
+	else
+	{
+		size_t new_length = std::min(list.MaxSize() + batch, MAX_LIST_LENGTH);
+		new_length -= new_length % batch;
+		list.MaxSize() = std::max(new_length, batch);
+	}
+
+	return batch_num;
+}
+
 //  优先从_free_lists[index]中获取空间
 void* ThreadCache::Allocate(size_t size)
 {
 	assert(size <= MAX_BYTES);
 
-	size_t align_size = SizeClass::RoundUp(size);
+	// 查一次表得到桶，未命中时再查桶对应的对齐后大小
 	size_t index = SizeClass::Index(size);
 
+	// 采样的判断在快路径上只有一次减法和比较
+	_bytes_until_sample -= (long long)size;
+	if (_bytes_until_sample < 0 && PickSample())
+	{
+		return HeapProfiler::GetInstance()->AllocateSampled(SizeClass::ClassSize(index), size);
+	}
+
+	FreeListStats::Add(_stats[index]._alloc, 1);
+	FreeListStats::Add(_stats[index]._requested, size);
+
 	if (!_free_lists[index].Empty())
 	{
+		_size -= SizeClass::ClassSize(index);
 		return _free_lists[index].Pop();
 	}
 	else
 	{
-		return FetchFromCentralCache(index, align_size);
+		return FetchFromCentralCache(index, SizeClass::ClassSize(index));
+	}
+}
+
+void ThreadCache::AllocateBatch(size_t size, size_t n, void** batch)
+{
+	assert(size <= MAX_BYTES);
+
+	size_t index = SizeClass::Index(size);
+	size_t align_size = SizeClass::ClassSize(index);
+	FreeList& list = _free_lists[index];
+
+	// 与逐个申请的采样率一致：这一批每越过一次采样间隔就采样一个对象，采样的对象放在最后几个位置
+	// 越过间隔之后剩下的字节计入下一个间隔，一批比间隔大很多时也不会少采
+	_bytes_until_sample -= (long long)(size * n);
+	size_t sampled = 0;
+	while (_bytes_until_sample < 0 && sampled < n)
+	{
+		long long overshoot = -_bytes_until_sample - (long long)size;
+		if (!PickSample())
+			break;
+		++sampled;
+		if (overshoot > 0)
+			_bytes_until_sample -= overshoot;
 	}
+
+	size_t count = n - sampled;
+	size_t filled = 0;
+	try
+	{
+		while (filled < count)
+		{
+			if (!list.Empty())
+			{
+				size_t k = std::min(count - filled, list.Size());
+				list.PopBatch(batch + filled, k);
+				_size -= k * align_size;
+				filled += k;
+				continue;
+			}
+
+			// 缺多少一次要多少，慢开始阶段要的个数比缺的多时按慢开始来，多出来的挂到自由链表
+			size_t want = count - filled;
+			size_t batch_num = std::max(NextFetchNum(index), want);
+
+			void* start = nullptr;
+			void* end = nullptr;
+			size_t actual_num = CentralCache::GetInstance(Numa::CurrentNode())->FetchRangeObj(start, end, batch_num, align_size);
+			assert(actual_num > 0);
+			FreeListStats::Add(_stats[index]._fetch, actual_num);
+
+			size_t k = std::min(want, actual_num);
+			for (size_t i = 0; i < k; ++i)
+			{
+				batch[filled++] = start;
+				start = NextObj(start);
+			}
+			if (actual_num > k)
+			{
+				list.PushRange(start, end, actual_num - k);
+				_size += (actual_num - k) * align_size;
+			}
+		}
+
+		for (size_t i = count; i < n; ++i)
+		{
+			try
+			{
+				batch[i] = HeapProfiler::GetInstance()->AllocateSampled(align_size, size);
+			}
+			catch (...)
+			{
+				for (size_t j = count; j < i; ++j)
+				{
+					HeapProfiler::GetInstance()->FreeSampled(PageCache::GetInstance()->MapObjectToSpan(batch[j]));
+				}
+				throw;
+			}
+		}
+	}
+	catch (...)
+	{
+		// 已经拿到的对象放回自由链表，整批申请要么全部成功要么什么都不占
+		if (filled > 0)
+		{
+			for (size_t i = 0; i + 1 < filled; ++i)
+			{
+				NextObj(batch[i]) = batch[i + 1];
+			}
+			list.PushRange(batch[0], batch[filled - 1], filled);
+			_size += filled * align_size;
+		}
+		throw;
+	}
+
+	FreeListStats::Add(_stats[index]._alloc, count);
+	FreeListStats::Add(_stats[index]._requested, size * count);
+}
+
+void ThreadCache::DeallocateBatch(void** batch, size_t n, size_t size)
+{
+	assert(n > 0);
+	assert(size <= MAX_BYTES);
+
+	// 先把这批对象串起来，整段挂到自由链表上
+	size_t index = SizeClass::Index(size);
+	for (size_t i = 0; i + 1 < n; ++i)
+	{
+		NextObj(batch[i]) = batch[i + 1];
+	}
+	_free_lists[index].PushRange(batch[0], batch[n - 1], n);
+	_size += n * SizeClass::ClassSize(index);
+	FreeListStats::Add(_stats[index]._free, n);
+
+	// 一批可能远超过MaxSize，按整批还给CentralCache，每批都可能直接进中转缓存
+	while (_free_lists[index].Size() >= _free_lists[index].MaxSize())
+	{
+		ListTooLong(index);
+	}
+
+	if (_size >= _max_size.load(std::memory_order_relaxed))
+	{
+		Scavenge();
+		std::unique_lock<std::mutex> lock(tc_list_mtx);
+		IncreaseCacheLimitLocked();
+	}
+	else if (_frees_until_decay <= n)
+	{
+		Scavenge();
+	}
+	else
+	{
+		_frees_until_decay -= n;
+	}
+}
+
+bool ThreadCache::PickSample()
+{
+	_bytes_until_sample = HeapProfiler::NextSampleInterval(_sample_rng);
+	return HeapProfiler::SamplePeriod() != 0 && !HeapProfiler::InProfiler();
 }
 
 void ThreadCache::Deallocate(void* ptr, size_t size)
@@ -59,19 +497,88 @@ void ThreadCache::Deallocate(void* ptr, size_t size)
 	//  找到映射的自由链表桶，被回收的对象空间插入
 	size_t index = SizeClass::Index(size);
 	_free_lists[index].Push(ptr);
+	_size += SizeClass::ClassSize(index);
+	FreeListStats::Add(_stats[index]._free, 1);
 
 	// 当链表长度大于一次批量申请的内存时，就开始还一段list给central cache
 	if (_free_lists[index].Size() >= _free_lists[index].MaxSize())
 	{
-		ListTooLong(_free_lists[index], size);
+		ListTooLong(index);
+	}
+
+	// 整个ThreadCache超出上限：先按低水位回收，再多要一点上限（预算不够时从别的线程偷）
+	if (_size >= _max_size.load(std::memory_order_relaxed))
+	{
+		Scavenge();
+		std::unique_lock<std::mutex> lock(tc_list_mtx);
+		IncreaseCacheLimitLocked();
+	}
+	else if (--_frees_until_decay == 0)
+	{
+		Scavenge();
 	}
 }
 
-void ThreadCache::ListTooLong(FreeList& list, size_t size)
+void ThreadCache::ListTooLong(size_t index)
+{
+	FreeList& list = _free_lists[index];
+	size_t batch = SizeClass::Info(index)._batch;
+
+	// 还一批（慢开始阶段链表不到一批，全部还回去），整批的可以直接进中转缓存
+	ReleaseToCentralCache(index, std::min(list.Size(), batch));
+
+	// 不到一批时继续慢开始；超过一批还反复超长，说明缓存得太多，缩小一批
+	if (list.MaxSize() < batch)
+	{
+		list.MaxSize() += 1;
+	}
+	else if (list.MaxSize() > batch)
+	{
+		if (++list.Overages() > MAX_OVERAGES)
+		{
+			list.MaxSize() -= batch;
+			list.Overages() = 0;
+		}
+	}
+}
+
+void ThreadCache::ReleaseToCentralCache(size_t index, size_t n)
 {
 	void* start = nullptr;
 	void* end = nullptr;
-	list.PopRange(start, end, list.MaxSize());  // 一个桶就会留取少量资源
+	_free_lists[index].PopRange(start, end, n);
+	FreeListStats::Add(_stats[index]._release, n);
+	_size -= n * SizeClass::ClassSize(index);
+
+	CentralCache::GetInstance(Numa::CurrentNode())->ReleaseRangeObj(start, end, n, SizeClass::ClassSize(index));
+}
+
+void ThreadCache::Scavenge()
+{
+	_frees_until_decay = DECAY_INTERVAL;
+
+	for (size_t i = 0; i < NUM_FREELIST; ++i)
+	{
+		FreeList& list = _free_lists[i];
+		size_t low_water = list.LowWater();
+		if (low_water > 0)
+		{
+			// 从上次回收到现在，至少有low_water个对象一直没被用到
+			// 按整批还：中转缓存里每批都不超过_batch个，不足一批的尾巴直接还给span
+			size_t batch = SizeClass::Info(i)._batch;
+			size_t drop = low_water > 1 ? low_water / 2 : 1;
+			while (drop > 0)
+			{
+				size_t n = std::min(drop, batch);
+				ReleaseToCentralCache(i, n);
+				drop -= n;
+			}
 
-	CentralCache::GetInstance()->ReleaseListToSpans(start, size);
-}
\ No newline at end of file
+			if (list.MaxSize() > batch)
+			{
+				list.MaxSize() = std::max(list.MaxSize() - batch, batch);
+			}
+		}
+		list.ClearLowWater();
+	}
+}
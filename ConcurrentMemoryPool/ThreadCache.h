@@ -2,25 +2,137 @@
 
 #include "Common.h"
 
+struct MallocStats;
+
+// 一个桶的计数
+// 只有缓存的拥有者（本线程，或者持有per-CPU槽位锁的线程）会写，统计时其它线程只读
+// 累加用relaxed的load + store而不是fetch_add，快路径上不会多出带lock前缀的指令
+struct FreeListStats
+{
+	std::atomic<uint64_t> _alloc{ 0 };		// Allocate的次数
+	std::atomic<uint64_t> _free{ 0 };		// Deallocate的次数
+	std::atomic<uint64_t> _fetch{ 0 };		// 从CentralCache拿到的对象个数
+	std::atomic<uint64_t> _release{ 0 };	// 还给CentralCache的对象个数
+	std::atomic<uint64_t> _requested{ 0 };	// Allocate传入的字节数之和
+
+	static void Add(std::atomic<uint64_t>& counter, uint64_t n)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+};
+
+// 缓存大小随需求调整（类似tcmalloc）：
+//	1. 单个链表：未命中时MaxSize先慢开始+1，到一批之后每次加一批；释放时反复超长就减一批
+//	2. 整个ThreadCache：缓存的字节数_size不超过自己的上限_max_size，所有上限之和受全局预算约束
+//	   超过上限时按低水位回收（一直没用到的对象还一半），再从预算里多要一点，预算用完就从别的线程那里偷
+//	3. 每释放DECAY_INTERVAL次也按低水位回收一次，一段时间没用到的链表逐渐缩小
+// 其它线程只会调低一个ThreadCache的上限，多出来的对象由它自己在下一次释放时还回去
 class ThreadCache
 {
+public:
+	static constexpr size_t DEFAULT_OVERALL_BYTES = 32 * 1024 * 1024;	// 所有ThreadCache的默认总预算
+	static constexpr size_t MIN_BYTES = 2 * MAX_BYTES;				// 被偷之后至少保留的上限
+	static constexpr size_t STEAL_BYTES = 64 * 1024;				// 每次增加上限的字节数
+	static constexpr size_t MAX_LIST_LENGTH = 8192;				// 单个链表MaxSize的上限
+	static constexpr size_t MAX_OVERAGES = 3;
+	static constexpr size_t DECAY_INTERVAL = 16 * 1024;
+
 private:
 	FreeList _free_lists[NUM_FREELIST];
+	FreeListStats _stats[NUM_FREELIST];
+
+	size_t _size = 0;						// 自由链表中对象的总字节数
+	std::atomic<size_t> _max_size{ 0 };		// 只在tc_list_mtx下修改，本线程读时不加锁
+	size_t _frees_until_decay = DECAY_INTERVAL;
+
+	// 所有存活的ThreadCache(包括per-CPU槽位中的)串成双向链表，统计时遍历
+	ThreadCache* _prev = nullptr;
+	ThreadCache* _next = nullptr;
+
+	// 堆采样：还要申请多少字节才采下一个对象，以及生成采样间隔的随机数状态
+	long long _bytes_until_sample = 0;
+	uint64_t _sample_rng = 0;
+
+	// 计数减到负数时调用：重新生成间隔，返回这一次是否真的要采样
+	bool PickSample();
+
+	// 慢开始：返回这一次向CentralCache要的个数，并调整MaxSize
+	size_t NextFetchNum(size_t index);
+
+	// 从链表头部取n个对象还给CentralCache
+	void ReleaseToCentralCache(size_t index, size_t n);
+
+	// 按低水位回收：每个链表上一直没用到的对象还一半，并缩小MaxSize
+	void Scavenge();
+
+	// 超出上限时调用：从全局预算里多要STEAL_BYTES，预算用完时从别的ThreadCache偷，调用方持有tc_list_mtx
+	void IncreaseCacheLimitLocked();
 
 public:
+	ThreadCache();
+
+	// 线程退出时，把自由链表中剩余的对象全部还给CentralCache
+	~ThreadCache();
+
 	// 申请和释放内存对象
 	void* Allocate(size_t size);
 	void Deallocate(void* ptr, size_t size);
 
+	// 批量申请/释放n个同样大小的对象：只查一次桶、判断一次采样，整段进出自由链表
+	// 自由链表不够时一次向CentralCache要齐剩下的个数
+	void AllocateBatch(size_t size, size_t n, void** batch);
+	void DeallocateBatch(void** batch, size_t n, size_t size);
+
 	// 从中心缓存获取对象
 	void* FetchFromCentralCache(size_t index, size_t size);
 
-	// 释放对象时，链表过长时，回收内存到CentralCache
-	void ListTooLong(FreeList& list, size_t size);
+	// 释放对象时，链表过长时，回收一批到CentralCache，反复过长就缩小MaxSize
+	void ListTooLong(size_t index);
+
+	// 自由链表中对象的总字节数和当前的上限
+	size_t CachedBytes() const { return _size; }
+	size_t MaxBytes() const { return _max_size.load(std::memory_order_relaxed); }
+
+	// 为当前线程创建ThreadCache(设置Ptr_TLS_ThreadCache)，并登记线程退出时的回收
+	static ThreadCache* Create();
+
+	// 没有ThreadCache可用时（线程退出阶段），单个对象直接与CentralCache交互
+	static void* AllocateNoCache(size_t size);
+	static void DeallocateNoCache(void* ptr, size_t size);
+
+	// 把所有ThreadCache（以及已经回收的）的计数累加到stats中
+	static void CollectStats(MallocStats& stats);
+
+	// 设置所有ThreadCache的总预算，已经分出去的上限之和超过预算时按比例调低
+	static void SetOverallBudget(size_t bytes);
+	static size_t OverallBudget();
 };
 
+// 设置所有线程缓存(包括per-CPU缓存)加起来最多缓存的字节数
+inline void ConcurrentSetThreadCacheBudget(size_t bytes)
+{
+	ThreadCache::SetOverallBudget(bytes);
+}
+
 // TLS thread local storage
-static _declspec(thread) ThreadCache* Ptr_TLS_ThreadCache = nullptr;
+// inline保证整个程序只有一份（static的话每个编译单元各有一份）
+inline thread_local ThreadCache* Ptr_TLS_ThreadCache = nullptr;
+
+// 线程的ThreadCache已经在退出时回收
+// 之后的申请/释放(其它thread_local对象的析构、libc释放自己的TLS数据等)不再创建ThreadCache，
+// 否则又会登记一次回收，线程退出时反复创建/回收
+inline thread_local bool Tls_ThreadCacheRecycled = false;
+
+// 获取当前线程的ThreadCache，第一次使用时创建；线程退出阶段返回nullptr
+inline ThreadCache* GetThreadCache()
+{
+	if (nullptr == Ptr_TLS_ThreadCache && !Tls_ThreadCacheRecycled)
+	{
+		ThreadCache::Create();
+	}
+
+	return Ptr_TLS_ThreadCache;
+}
 
 // 两个问题：
 //	1.什么时候为需要ThreadCache的线程创建ThreadCache对象
@@ -0,0 +1,156 @@
+﻿#pragma once
+
+#include "Common.h"
+
+// ThreadCache与CentralCache之间的中转缓存（每个size class一个）
+// 以“整批”为单位缓存已经串好的对象链表：ListTooLong还回来的一批原样放进来，
+// FetchFromCentralCache需要时原样取走
+// 命中时只需要一次CAS，不用拿桶锁、不用遍历链表、也不用逐个对象查span
+//
+// 实现是有界的MPMC环形队列（Dmitry Vyukov），每个槽位用序号区分空/满
+//
+// 放进来的批次如果一直没人取，对象就一直挂在这里，所属的span永远空不出来
+// 所以记录两次清扫之间批数的最低值：这么多批在整个周期里都没被用到，由CentralCache::Plunder还回span
+class TransferCache
+{
+private:
+	static const size_t MAX_BATCHES = 16;			// 环形队列槽位上限（2的幂）
+	static const size_t MAX_CACHE_BYTES = 512 * 1024;	// 每个size class最多缓存的字节数
+
+	struct Batch
+	{
+		std::atomic<size_t> _seq;
+		void* _start;
+		void* _end;
+		size_t _n;
+	};
+
+	Batch _slots[MAX_BATCHES];
+	size_t _mask = 0;		// 实际容量-1
+
+	alignas(64) std::atomic<size_t> _enqueue_pos;
+	alignas(64) std::atomic<size_t> _dequeue_pos;
+
+	std::atomic<size_t> _objects{ 0 };		// 缓存的对象个数，只用于统计，每批更新一次
+	std::atomic<size_t> _low_water{ 0 };	// 上次清扫之后批数的最低值
+
+public:
+	// 按对象大小和一批的个数确定容量，大对象少缓存几批
+	void Init(size_t size, size_t batch_num)
+	{
+		size_t capacity = MAX_BATCHES;
+		while (capacity > 2 && capacity * batch_num * size > MAX_CACHE_BYTES)
+		{
+			capacity >>= 1;
+		}
+		_mask = capacity - 1;
+
+		for (size_t i = 0; i < MAX_BATCHES; ++i)
+		{
+			_slots[i]._seq.store(i, std::memory_order_relaxed);
+		}
+		_enqueue_pos.store(0, std::memory_order_relaxed);
+		_dequeue_pos.store(0, std::memory_order_relaxed);
+	}
+
+	// 放入一批[start, end]共n个对象，满了返回false
+	bool Insert(void* start, void* end, size_t n)
+	{
+		Batch* slot = nullptr;
+		size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+		while (true)
+		{
+			slot = &_slots[pos & _mask];
+			size_t seq = slot->_seq.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if (dif == 0)
+			{
+				if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (dif < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = _enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		slot->_start = start;
+		slot->_end = end;
+		slot->_n = n;
+		slot->_seq.store(pos + 1, std::memory_order_release);
+		_objects.fetch_add(n, std::memory_order_relaxed);
+
+		return true;
+	}
+
+	// 取出一整批，返回对象个数，空了返回0
+	size_t Remove(void*& start, void*& end)
+	{
+		Batch* slot = nullptr;
+		size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+		while (true)
+		{
+			slot = &_slots[pos & _mask];
+			size_t seq = slot->_seq.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (dif == 0)
+			{
+				if (_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (dif < 0)
+			{
+				return 0;
+			}
+			else
+			{
+				pos = _dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		start = slot->_start;
+		end = slot->_end;
+		size_t n = slot->_n;
+		slot->_seq.store(pos + _mask + 1, std::memory_order_release);
+		_objects.fetch_sub(n, std::memory_order_relaxed);
+
+		// 只是启发式的统计，并发时丢掉一次更新无所谓，不值得在取批次的路径上再做CAS
+		size_t batches = Batches();
+		if (batches < _low_water.load(std::memory_order_relaxed))
+		{
+			_low_water.store(batches, std::memory_order_relaxed);
+		}
+
+		return n;
+	}
+
+	// 当前缓存的批数（近似值）
+	size_t Batches() const
+	{
+		size_t enqueue = _enqueue_pos.load(std::memory_order_relaxed);
+		size_t dequeue = _dequeue_pos.load(std::memory_order_relaxed);
+		return enqueue > dequeue ? enqueue - dequeue : 0;
+	}
+
+	// 上次ResetLowWater之后一直没被取走的批数
+	size_t LowWater() const
+	{
+		return _low_water.load(std::memory_order_relaxed);
+	}
+
+	// 开始新的一个清扫周期
+	void ResetLowWater()
+	{
+		_low_water.store(Batches(), std::memory_order_relaxed);
+	}
+
+	// 当前缓存的对象个数（近似值）
+	size_t Objects() const
+	{
+		return _objects.load(std::memory_order_relaxed);
+	}
+};
@@ -1,5 +1,11 @@
 ﻿#include "ObjectPool.h"
 #include "ConcurrentAlloc.h"
+#include "ConcurrentAllocator.h"
+#include "MallocStats.h"
+#include "HeapProfiler.h"
+
+#include <list>
+#include <map>
 
 void Alloc1()
 {
@@ -70,13 +76,1304 @@ void TestConcurrentAlloc2()
 
 
 
-//int main()
-//{
-//	// TestObjectPool();
-//	//TLSTest();
-//
-//	TestConcurrentAlloc2();
-//
-//
-//	return 0;
-//}
\ No newline at end of file
+// 大于128页的走大对象缓存/SystemAlloc，32~128页之间的走PageCache
+void TestBigAlloc()
+{
+	void* p1 = ConcurrentAlloc(257 * 1024);
+	void* p2 = ConcurrentAlloc(129 * 8 * 1024);
+
+	assert(((uintptr_t)p1 & ((1 << PAGE_SHIFT) - 1)) == 0);
+	assert(((uintptr_t)p2 & ((1 << PAGE_SHIFT) - 1)) == 0);
+	memset(p1, 0xab, 257 * 1024);
+	memset(p2, 0xcd, 129 * 8 * 1024);
+
+	ConcurrentFree(p1);
+	ConcurrentFree(p2);
+}
+
+// 多个线程同时申请/释放大对象：32~128页走PageCache，超过128页不经过_page_mtx
+void TestMultiThreadBigAlloc()
+{
+	std::vector<std::thread> vthread;
+	for (size_t t = 0; t < 4; ++t)
+	{
+		vthread.emplace_back([t]() {
+			std::vector<std::pair<char*, size_t>> v;
+			for (size_t i = 0; i < 200; ++i)
+			{
+				size_t size = (33 + (i * 7 + t * 13) % 160) * 8 * 1024;
+				char* ptr = (char*)ConcurrentAlloc(size);
+				ptr[0] = (char)i;
+				ptr[size - 1] = (char)i;
+				v.emplace_back(ptr, size);
+
+				if (v.size() > 8)
+				{
+					auto& front = v.front();
+					assert(front.first[0] == front.first[front.second - 1]);
+					ConcurrentFree(front.first);
+					v.erase(v.begin());
+				}
+			}
+
+			for (auto& e : v)
+			{
+				ConcurrentFree(e.first);
+			}
+		});
+	}
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+}
+
+void MultiThreadAlloc()
+{
+	std::vector<void*> v;
+	for (size_t i = 0; i < 1000; ++i)
+	{
+		size_t size = (16 + i) % 8192 + 1;
+		void* ptr = ConcurrentAlloc(size);
+		memset(ptr, 0, size);
+		v.push_back(ptr);
+	}
+
+	for (auto ptr : v)
+	{
+		ConcurrentFree(ptr);
+	}
+}
+
+void TestMultiThread()
+{
+	std::vector<std::thread> vthread;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		vthread.emplace_back(MultiThreadAlloc);
+	}
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+}
+
+// 线程退出后，ThreadCache中缓存的对象还给CentralCache，ThreadCache被回收，下一个线程复用同一个ThreadCache对象
+void TestThreadExit()
+{
+	ThreadCache* tc1 = nullptr;
+	ThreadCache* tc2 = nullptr;
+
+	const size_t index = SizeClass::Index(16);
+	MallocStats before;
+	ConcurrentGetStats(before);
+
+	// 每10个留一个不释放，span不会整个空出来还给PageCache，退出时还回去的对象都留在CentralCache里看得到
+	std::vector<void*> kept;
+	MallocStats during;
+	std::thread t1([&]() {
+		std::vector<void*> v;
+		for (size_t i = 0; i < 1000; ++i)
+		{
+			v.push_back(ConcurrentAlloc(16));
+		}
+		for (size_t i = 0; i < v.size(); ++i)
+		{
+			if (i % 10 == 0)
+				kept.push_back(v[i]);
+			else
+				ConcurrentFree(v[i]);
+		}
+		tc1 = Ptr_TLS_ThreadCache;
+		ConcurrentGetStats(during);
+		});
+	t1.join();
+
+	// 线程退出时自由链表上的对象经ReleaseListToSpans还给了CentralCache
+	size_t cached = during._classes[index]._thread_cache_objects - before._classes[index]._thread_cache_objects;
+	assert(cached > 0);
+
+	MallocStats after;
+	ConcurrentGetStats(after);
+	assert(after._classes[index]._thread_cache_objects == before._classes[index]._thread_cache_objects);
+	assert(after._classes[index]._central_cache_objects + after._classes[index]._transfer_cache_objects
+		== during._classes[index]._central_cache_objects + during._classes[index]._transfer_cache_objects + cached);
+
+	for (void* p : kept)
+	{
+		ConcurrentFree(p);
+	}
+
+	std::thread t2([&]() {
+		void* ptr = ConcurrentAlloc(16);
+		tc2 = Ptr_TLS_ThreadCache;
+		ConcurrentFree(ptr);
+		});
+	t2.join();
+
+	assert(tc1 != nullptr);
+	assert(tc1 == tc2);
+}
+
+// 空闲span归还给系统后，再次被NewSpan交出去时仍然可以正常读写
+void TestReleaseFreePages()
+{
+	PageCache* page_cache = PageCache::GetInstance();
+
+	// 大于256KB的对象直接从PageCache切span，释放后就是PageCache里的空闲span
+	const size_t size = 300 * 1024;
+	const size_t pages = SizeClass::RoundUp(size) >> PAGE_SHIFT;
+	std::vector<void*> v;
+	for (size_t i = 0; i < 16; ++i)
+	{
+		v.push_back(ConcurrentAlloc(size));
+		memset(v.back(), 0x5a, size);
+	}
+	for (auto ptr : v)
+	{
+		ConcurrentFree(ptr);
+	}
+
+	// 空闲span全部归还；已经归还的不会再算一次
+	MallocStats before;
+	ConcurrentGetStats(before);
+	page_cache->_page_mtx.lock();
+	size_t released = page_cache->ReleaseFreePages(SIZE_MAX);
+	size_t again = page_cache->ReleaseFreePages(SIZE_MAX);
+	page_cache->_page_mtx.unlock();
+	assert(released >= 16 * pages);
+	assert(again == 0);
+
+	// 空闲span的物理页算进_released_bytes；大对象缓存里的span整个unmap，不再计入_mapped_bytes
+	MallocStats after;
+	ConcurrentGetStats(after);
+	size_t unmapped = before._large_cache_bytes;
+	assert(after._large_cache_bytes == 0);
+	assert(after._mapped_bytes + unmapped == before._mapped_bytes);
+	assert(after._released_bytes + unmapped >= before._released_bytes + (released << PAGE_SHIFT));
+	assert(after._page_cache_bytes + (released << PAGE_SHIFT) <= before._page_cache_bytes + unmapped);
+
+	// 再次使用的span先重新提交
+	void* ptr = ConcurrentAlloc(size);
+	assert(!page_cache->MapObjectToSpan(ptr)->_is_returned);
+	memset(ptr, 0x5a, size);
+	ConcurrentFree(ptr);
+
+	// 后台线程按速率归还：刚释放的span与已归还的合并后按未归还处理，由回收线程还回去
+	ConcurrentGetStats(before);
+	assert(before._page_cache_bytes >= size);
+	page_cache->SetReleaseRate(64 << 20);
+	for (int i = 0; i < 100; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		ConcurrentGetStats(after);
+		if (after._released_bytes > before._released_bytes)
+			break;
+	}
+	page_cache->SetReleaseRate(0);
+	assert(after._released_bytes > before._released_bytes);
+	assert(after._page_cache_bytes < before._page_cache_bytes);
+}
+
+// 启用per-CPU前端后，之前由ThreadCache申请的对象也能正常释放
+void TestPerCpuCache()
+{
+	void* before = ConcurrentAlloc(32);
+
+	if (!PerCpuCache::Enable())
+	{
+		cout << "rseq not available, per-cpu cache skipped" << endl;
+		ConcurrentFree(before);
+		return;
+	}
+	assert(PerCpuCache::Enabled());
+	assert(PerCpuCache::CurrentCpu() >= 0);
+
+	ConcurrentFree(before);
+
+	void* batch[100];
+	ConcurrentAllocBatch(200, 100, batch);
+	ConcurrentFreeBatch(batch, 100, 200);
+
+	// 线程比CPU多、一起申请释放，抢不到槽位的线程不经缓存完成，不会各自留下一份ThreadCache
+	MallocStats before_stats;
+	ConcurrentGetStats(before_stats);
+
+	const size_t kThreads = 16;
+	std::atomic<size_t> done(0);
+	std::atomic<bool> finish(false);
+	std::vector<std::thread> vthread;
+	for (size_t t = 0; t < kThreads; ++t)
+	{
+		vthread.emplace_back([&]() {
+			std::vector<void*> objs(100);
+			for (int round = 0; round < 2000; ++round)
+			{
+				for (size_t i = 0; i < objs.size(); ++i)
+					objs[i] = ConcurrentAlloc(16 + (i % 8) * 100);
+				for (size_t i = 0; i < objs.size(); ++i)
+					ConcurrentFree(objs[i], 16 + (i % 8) * 100);
+			}
+			ConcurrentAllocBatch(200, objs.size(), objs.data());
+			ConcurrentFreeBatch(objs.data(), objs.size(), 200);
+
+			++done;
+			while (!finish)
+				std::this_thread::yield();
+		});
+	}
+	while (done != kThreads)
+		std::this_thread::yield();
+
+	MallocStats during_stats;
+	ConcurrentGetStats(during_stats);
+	assert(during_stats._thread_cache_count == before_stats._thread_cache_count);
+
+	finish = true;
+	for (auto& t : vthread)
+		t.join();
+
+	TestMultiThread();
+	TestMultiThreadBigAlloc();
+}
+
+// 一个线程整批还回来的对象，另一个线程整批取走
+void TestTransferCache()
+{
+	const size_t size = 1024;
+	const size_t n = SizeClass::NumMoveSize(size) * 4;
+
+	std::vector<void*> v;
+	std::thread([&]() {
+		for (size_t i = 0; i < n; ++i)
+		{
+			v.push_back(ConcurrentAlloc(size));
+		}
+		}).join();
+
+	std::thread([&]() {
+		for (auto ptr : v)
+		{
+			ConcurrentFree(ptr);
+		}
+		}).join();
+
+	std::thread([&]() {
+		for (size_t i = 0; i < n; ++i)
+		{
+			void* ptr = ConcurrentAlloc(size);
+			memset(ptr, 0, size);
+			v[i] = ptr;
+		}
+		std::sort(v.begin(), v.end());
+		assert(std::unique(v.begin(), v.end()) == v.end());
+		for (auto ptr : v)
+		{
+			ConcurrentFree(ptr);
+		}
+		}).join();
+}
+
+// 线程都退出之后，中转缓存里的批次没人再取，清扫之后span要能回到PageCache并还给系统
+void TestTransferCachePlunder()
+{
+	const size_t size = 7000;	// 前面的用例没有用过这个桶
+	const size_t index = SizeClass::Index(size);
+	const size_t n = SizeClass::NumMoveSize(size) * 64;	// 慢开始结束后才会整批地还
+
+	std::vector<void*> v;
+	std::thread([&]() {
+		for (size_t i = 0; i < n; ++i)
+		{
+			v.push_back(ConcurrentAlloc(size));
+		}
+		}).join();
+
+	std::thread([&]() {
+		for (auto ptr : v)
+		{
+			ConcurrentFree(ptr);
+		}
+		}).join();
+
+	MallocStats before;
+	ConcurrentGetStats(before);
+	assert(before._classes[index]._transfer_cache_objects > 0);
+	assert(before._classes[index]._span_count > 0);
+
+	size_t released = ConcurrentReleaseFreeMemory();
+
+	MallocStats after;
+	ConcurrentGetStats(after);
+	assert(after._classes[index]._transfer_cache_objects == 0);
+	assert(after._classes[index]._central_cache_objects == 0);
+	assert(after._classes[index]._span_count == 0);
+	assert(released >= n * size);
+	assert(after._released_bytes >= before._released_bytes + n * size);
+}
+
+// span的字节数不是对象大小的整数倍时，切出来的对象不能越过span的末尾
+void TestSpanCarving()
+{
+	const size_t size = 9000;	// 对齐到9216，一个span切不整
+	std::vector<char*> v;
+	for (size_t i = 0; i < 200; ++i)
+	{
+		char* ptr = (char*)ConcurrentAlloc(size);
+		memset(ptr, (int)i, size);
+		v.push_back(ptr);
+	}
+
+	std::sort(v.begin(), v.end());
+	for (size_t i = 1; i < v.size(); ++i)
+	{
+		assert(v[i] - v[i - 1] >= (ptrdiff_t)size);
+	}
+
+	for (auto ptr : v)
+	{
+		ConcurrentFree(ptr);
+	}
+}
+
+// 三层基数树：4GB以上的页号，以及中间节点/叶子按需创建
+void TestPageMap()
+{
+#if defined(_WIN64) || UINTPTR_MAX > 0xFFFFFFFFu
+	static SpanMap map;
+	const size_t root_bytes = map.MetadataBytes();
+
+	const PAGE_ID high = ((PAGE_ID)5 << 30) >> PAGE_SHIFT;		// 5GB处
+	const PAGE_ID top = (((PAGE_ID)1 << 47) >> PAGE_SHIFT) - 1;	// 用户态最高的一页
+	Span span;
+
+	// 没建过节点的页查不到，也不会因为查找而建节点
+	assert(map.get(high) == nullptr);
+	assert(map.get(top) == nullptr);
+	assert(map.get((PAGE_ID)1 << 40) == nullptr);	// 超出48位地址
+	assert(map.MetadataBytes() == root_bytes);
+
+	// 第一次Ensure建一个中间节点和一个叶子，同一个叶子内再Ensure不再增长
+	assert(map.Ensure(high, 1));
+	size_t one_path = map.MetadataBytes() - root_bytes;
+	assert(one_path > 0);
+	assert(map.Ensure(high + 1, 16));
+	assert(map.MetadataBytes() - root_bytes == one_path);
+
+	map.set(high, &span);
+	map.set(high + 16, &span);
+	assert(map.get(high) == &span);
+	assert(map.get(high + 16) == &span);
+	assert(map.get(high + 1) == nullptr);
+	assert(map.get(high + ((PAGE_ID)1 << 32)) == nullptr);	// 只差高位的页号不会混到一起
+
+	// 很远的另一段地址建自己的路径
+	assert(map.Ensure(top, 1));
+	assert(map.MetadataBytes() - root_bytes == 2 * one_path);
+	map.set(top, &span);
+	assert(map.get(top) == &span);
+	assert(map.get(high) == &span);
+
+	// 内存池自己的对象一般就在4GB以上，都能查到span
+	void* p = ConcurrentAlloc(100);
+	assert(PageCache::GetInstance()->MapObjectToSpan(p)->_obj_size >= 100);
+	ConcurrentFree(p);
+#endif
+}
+
+// 查表得到的桶和对齐大小与分段规则一致
+void TestSizeClass()
+{
+	size_t last_index = 0;
+	for (size_t size = 1; size <= MAX_BYTES; ++size)
+	{
+		size_t index = SizeClass::Index(size);
+		size_t align_size = SizeClass::RoundUp(size);
+
+		assert(index < NUM_FREELIST);
+		assert(index == last_index || index == last_index + 1);
+		assert(align_size >= size);
+		assert(align_size - size < align_size / 8 + 8);
+		assert(SizeClass::ClassSize(index) == align_size);
+		assert(SizeClass::Index(align_size) == index);
+		assert(SizeClass::Info(index)._batch == SizeClass::NumMoveSize(align_size));
+		assert(SizeClass::Info(index)._pages == SizeClass::NumMovePage(align_size));
+
+		last_index = index;
+	}
+	assert(last_index == NUM_FREELIST - 1);
+	assert(SizeClass::Index(0) == 0);
+}
+
+// UnitTest链接了ConcurrentMemoryPoolNewDelete，new出来的对象都在内存池的span中
+void TestNewDelete()
+{
+	int* p1 = new int(1);
+	assert(PageCache::GetInstance()->MapObjectToSpan(p1) != nullptr);
+	delete p1;
+
+	// 编译器知道大小，会调用sized delete
+	std::vector<std::string> v;
+	for (size_t i = 0; i < 1000; ++i)
+	{
+		v.push_back(std::string(i, 'x'));
+		assert(i < 16 || ((uintptr_t)v.back().data() & 15) == 0);
+	}
+	v.clear();
+
+	struct alignas(64) CacheLine { char buf[64]; };
+	CacheLine* p2 = new CacheLine[3];
+	assert(((uintptr_t)p2 & 63) == 0);
+	delete[] p2;
+
+	struct alignas(4096) Page { char buf[100]; };
+	Page* p3 = new Page;
+	assert(((uintptr_t)p3 & 4095) == 0);
+	delete p3;
+
+	// 有尺寸的释放
+	void* p4 = ConcurrentAlloc(100);
+	ConcurrentFree(p4, 100);
+}
+
+void TestAlignedAlloc()
+{
+	const size_t sizes[] = { 1, 24, 100, 1000, 5000, 70 * 1024, 300 * 1024, 2 << 20 };
+	for (size_t align = 8; align <= ((size_t)4 << 20); align <<= 1)
+	{
+		for (size_t size : sizes)
+		{
+			void* p1 = ConcurrentAllocAligned(size, align);
+			void* p2 = ConcurrentAllocAligned(size, align);
+			assert(((uintptr_t)p1 & (align - 1)) == 0);
+			assert(((uintptr_t)p2 & (align - 1)) == 0);
+			assert(ConcurrentUsableSize(p1) >= size);
+			if (align >= ((size_t)1 << PAGE_SHIFT))
+			{
+				// 整页申请：只占max(size, align)，不会因为对齐凑到MAX_BYTES以上
+				size_t pages = SizeClass::_RoundUp(size, (size_t)1 << PAGE_SHIFT);
+				assert(ConcurrentUsableSize(p1) == std::max(pages, align));
+			}
+			memset(p1, 0x11, size);
+			memset(p2, 0x22, size);
+
+			ConcurrentFree(p1);
+			ConcurrentFreeAligned(p2, size, align);
+		}
+	}
+
+	// 不超过一页的对齐由桶保证：对象大小是align的整数倍
+	for (size_t align = 16; align <= ((size_t)1 << PAGE_SHIFT); align <<= 1)
+	{
+		size_t size = SizeClass::AlignedSize(align / 2 + 1, align);
+		assert(size != 0 && size <= MAX_BYTES);
+		assert(size % align == 0);
+	}
+	assert(SizeClass::AlignedSize(100, (size_t)2 << PAGE_SHIFT) == 0);
+	assert(SizeClass::AlignedSize(MAX_BYTES + 1, 64) == 0);
+
+	// 整页申请的小对象按大对象释放，空出来的span能被其它大小的申请重新使用
+	void* p = ConcurrentAllocAligned(64, (size_t)64 * 1024);
+	assert(PageCache::GetInstance()->MapObjectToSpan(p)->_is_aligned);
+	p = ConcurrentRealloc(p, 100);		// 搬到小对象的桶里
+	assert(!PageCache::GetInstance()->MapObjectToSpan(p)->_is_aligned);
+	ConcurrentFree(p);
+	p = ConcurrentAllocAligned(64, (size_t)64 * 1024);
+	ConcurrentFreeAligned(p, 64, (size_t)64 * 1024);
+}
+
+static void FillPattern(char* ptr, size_t n)
+{
+	for (size_t i = 0; i < n; i += 512)
+		ptr[i] = (char)(i / 512);
+}
+
+static bool CheckPattern(const char* ptr, size_t n)
+{
+	for (size_t i = 0; i < n; i += 512)
+	{
+		if (ptr[i] != (char)(i / 512))
+			return false;
+	}
+	return true;
+}
+
+void TestRealloc()
+{
+	// 同一个桶内原地
+	char* p1 = (char*)ConcurrentAlloc(100);
+	assert(ConcurrentRealloc(p1, 104) == p1);
+	ConcurrentFree(p1);
+
+	// 小对象 -> 大对象 -> 小对象
+	char* p2 = (char*)ConcurrentAlloc(1000);
+	FillPattern(p2, 1000);
+	p2 = (char*)ConcurrentRealloc(p2, 500 * 1024);
+	assert(CheckPattern(p2, 1000));
+	FillPattern(p2, 500 * 1024);
+	p2 = (char*)ConcurrentRealloc(p2, 2000);
+	assert(CheckPattern(p2, 2000));
+	ConcurrentFree(p2);
+
+	// 大对象缩小一定是原地的
+	char* p3 = (char*)ConcurrentAlloc(800 * 1024);
+	FillPattern(p3, 800 * 1024);
+	assert(ConcurrentRealloc(p3, 400 * 1024) == p3);
+	assert(CheckPattern(p3, 400 * 1024));
+
+	// 大对象逐步扩大，页中的数据保留，超过128页后走mremap
+	size_t size = 400 * 1024;
+	while (size < (8 << 20))
+	{
+		size_t new_size = size + size / 4;
+		p3 = (char*)ConcurrentRealloc(p3, new_size);
+		assert(((uintptr_t)p3 & ((1 << PAGE_SHIFT) - 1)) == 0);
+		assert(CheckPattern(p3, size));
+		FillPattern(p3, new_size);
+		size = new_size;
+	}
+
+	// 再缩回PageCache能管理的大小
+	p3 = (char*)ConcurrentRealloc(p3, 300 * 1024);
+	assert(CheckPattern(p3, 300 * 1024));
+	ConcurrentFree(p3);
+
+	assert(ConcurrentRealloc(ConcurrentAlloc(10), 0) == nullptr);
+}
+
+void TestBatchAlloc()
+{
+	const size_t sizes[] = { 8, 100, 1000, 20 * 1024, 300 * 1024 };
+	const size_t counts[] = { 1, 7, 1000 };
+	for (size_t size : sizes)
+	{
+		for (size_t n : counts)
+		{
+			if (size > MAX_BYTES && n > 7)
+				continue;
+
+			std::vector<void*> batch(n);
+			ConcurrentAllocBatch(size, n, batch.data());
+			for (void* p : batch)
+			{
+				assert(ConcurrentUsableSize(p) >= size);
+				memset(p, 0x5a, size);
+			}
+			std::vector<void*> sorted(batch);
+			std::sort(sorted.begin(), sorted.end());
+			assert(std::unique(sorted.begin(), sorted.end()) == sorted.end());
+
+			ConcurrentFreeBatch(batch.data(), n, size);
+		}
+	}
+
+	// 不带大小的释放：不同大小混在一起，相邻同样大小的合成一段
+	std::vector<void*> mixed;
+	for (size_t i = 0; i < 300; ++i)
+	{
+		void* objs[16];
+		size_t size = (i % 3 == 0) ? 48 : (i % 3 == 1 ? 4000 : 400 * 1024);
+		size_t n = size > MAX_BYTES ? 1 : 16;
+		ConcurrentAllocBatch(size, n, objs);
+		mixed.insert(mixed.end(), objs, objs + n);
+	}
+	ConcurrentFreeBatch(mixed.data(), mixed.size());
+
+	// 按页对齐的span记着申请的大小，紧跟在同样大小的普通对象后面也不能并进同一段还给自由链表
+	const size_t kPairs = 8;
+	void* pairs[kPairs * 2];
+	for (size_t i = 0; i < kPairs; ++i)
+	{
+		pairs[2 * i] = ConcurrentAlloc(64);
+		pairs[2 * i + 1] = ConcurrentAllocAligned(64, 64 * 1024);
+		assert(((uintptr_t)pairs[2 * i + 1] & (64 * 1024 - 1)) == 0);
+	}
+	ConcurrentFreeBatch(pairs, kPairs * 2);
+
+	void* reused[kPairs * 4];
+	for (void*& p : reused)
+	{
+		p = ConcurrentAlloc(64);
+		for (size_t i = 0; i < kPairs; ++i)
+			assert(p != pairs[2 * i + 1]);
+	}
+	for (void* p : reused)
+		ConcurrentFree(p, 64);
+
+	// 与逐个申请/释放的对象互通，计数按对象个数累加
+	MallocStats before;
+	ConcurrentGetStats(before);
+	void* objs[100];
+	ConcurrentAllocBatch(64, 100, objs);
+	for (size_t i = 0; i < 50; ++i)
+		ConcurrentFree(objs[i], 64);
+	ConcurrentFreeBatch(objs + 50, 50);
+	MallocStats after;
+	ConcurrentGetStats(after);
+	size_t index = SizeClass::Index(64);
+	assert(after._classes[index]._alloc_count - before._classes[index]._alloc_count >= 100);
+	assert(after._classes[index]._free_count - before._classes[index]._free_count >= 100);
+}
+
+// 缓存大小随需求调整：空闲的链表逐渐缩小，超出上限的线程从空闲线程那里偷预算
+void TestThreadCacheBudget()
+{
+	// 一次突发之后只用别的桶，突发留下的缓存按低水位逐步还回去
+	std::thread t1([]() {
+		std::vector<void*> burst(4000);
+		for (auto& p : burst)
+			p = ConcurrentAlloc(1000);
+		for (void* p : burst)
+			ConcurrentFree(p);
+
+		ThreadCache* tc = GetThreadCache();
+		for (size_t i = 0; i < ThreadCache::DECAY_INTERVAL * 16; ++i)
+		{
+			void* p = ConcurrentAlloc(16);
+			ConcurrentFree(p);
+		}
+		assert(tc->CachedBytes() < 4096);
+		assert(tc->CachedBytes() <= tc->MaxBytes());
+	});
+	t1.join();
+
+	// 先清零再设置：已有的ThreadCache都降到最小上限，预算剩下的部分给新线程
+	ConcurrentSetThreadCacheBudget(0);
+	ConcurrentSetThreadCacheBudget(4 << 20);
+
+	MallocStats stats;
+	ConcurrentGetStats(stats);
+	assert(stats._thread_cache_budget_bytes == (4 << 20));
+
+	auto burst = []() {
+		std::vector<void*> objs(2000);
+		for (int round = 0; round < 4; ++round)
+		{
+			for (auto& p : objs)
+				p = ConcurrentAlloc(2000);
+			for (void* p : objs)
+				ConcurrentFree(p);
+		}
+	};
+
+	// t2突发之后闲置，上限留在预算里；t3一直超出上限，只能从t2那里偷
+	std::atomic<int> phase(0);
+	ThreadCache* idle = nullptr;
+	size_t idle_max = 0;
+	std::thread t2([&]() {
+		burst();
+		idle = GetThreadCache();
+		idle_max = idle->MaxBytes();
+		phase = 1;
+		while (phase != 2)
+			std::this_thread::yield();
+	});
+	while (phase != 1)
+		std::this_thread::yield();
+	assert(idle_max > ThreadCache::MIN_BYTES);
+
+	std::thread t3([&]() {
+		burst();
+		burst();
+	});
+	t3.join();
+	assert(idle->MaxBytes() < idle_max);
+	assert(idle->MaxBytes() >= ThreadCache::MIN_BYTES);
+
+	phase = 2;
+	t2.join();
+
+	ConcurrentSetThreadCacheBudget(ThreadCache::DEFAULT_OVERALL_BYTES);
+}
+
+void TestConcurrentAllocator()
+{
+	// 节点容器：rebind到节点类型，节点有尺寸地还给前端缓存
+	std::map<int, std::string, std::less<int>, ConcurrentAllocator<std::pair<const int, std::string>>> m;
+	std::list<int, ConcurrentAllocator<int>> l;
+	std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, ConcurrentAllocator<std::pair<const int, int>>> um;
+	for (int i = 0; i < 10000; ++i)
+	{
+		m.emplace(i, std::to_string(i));
+		l.push_back(i);
+		um[i] = i;
+	}
+	assert(PageCache::GetInstance()->MapObjectToSpan(&*l.begin()) != nullptr);
+	for (int i = 0; i < 10000; i += 2)
+	{
+		m.erase(i);
+		um.erase(i);
+	}
+	l.remove_if([](int x) { return x % 3 == 0; });
+	assert(m.size() == 5000 && um.size() == 5000 && m.at(9999) == "9999");
+
+	// 超过8字节的对齐按ConcurrentAllocAligned申请，大数组走PageCache
+	struct alignas(64) CacheLine { char buf[64]; };
+	std::vector<CacheLine, ConcurrentAllocator<CacheLine>> v;
+	for (size_t n = 1; n <= 64 * 1024; n *= 4)
+	{
+		v.resize(n);
+		assert(((uintptr_t)v.data() & 63) == 0);
+	}
+
+	assert(ConcurrentAllocator<int>() == ConcurrentAllocator<double>());
+	ConcurrentAllocator<int> a;
+	bool thrown = false;
+	try
+	{
+		a.allocate(a.max_size() + 1);
+	}
+	catch (const std::bad_alloc&)
+	{
+		thrown = true;
+	}
+	assert(thrown);
+
+	// pmr容器
+	std::pmr::memory_resource* mr = ConcurrentMemoryResource::GetInstance();
+	ConcurrentMemoryResource other;
+	assert(mr->is_equal(other) && !mr->is_equal(*std::pmr::new_delete_resource()));
+
+	std::pmr::map<int, std::pmr::string> pm(mr);
+	for (int i = 0; i < 1000; ++i)
+	{
+		pm.emplace(i, std::string(i % 100, 'x'));
+	}
+	assert(pm[99].size() == 99);
+
+	void* p = mr->allocate(1000, 256);
+	assert(((uintptr_t)p & 255) == 0);
+	other.deallocate(p, 1000, 256);
+}
+
+// 超过128页的span释放后留在大对象缓存里，再申请时按best-fit切出来，不再mmap
+void TestLargeObjectCache()
+{
+	const size_t MB = 1024 * 1024;
+
+	// 先清空缓存，之前的用例留下的span不影响下面的地址判断
+	PageCache::GetInstance()->SetLargeCacheLimit(0);
+	PageCache::GetInstance()->SetLargeCacheLimit(64 * MB);
+
+	MallocStats before;
+	ConcurrentGetStats(before);
+	assert(before._large_cache_bytes == 0);
+
+	void* p1 = ConcurrentAlloc(4 * MB);
+	ConcurrentFree(p1);
+
+	MallocStats stats;
+	ConcurrentGetStats(stats);
+	assert(stats._large_cache_bytes == 4 * MB);
+	assert(stats._mapped_bytes == before._mapped_bytes + 4 * MB);
+
+	// 同样大小直接命中，小一些的从头部切出来
+	void* p2 = ConcurrentAlloc(4 * MB);
+	assert(p2 == p1);
+	ConcurrentFree(p2);
+
+	void* p3 = ConcurrentAlloc(3 * MB);
+	assert(p3 == p1);
+	void* p4 = ConcurrentAlloc(2 * MB);
+	assert(p4 != p1);
+	memset(p3, 0x33, 3 * MB);
+	memset(p4, 0x44, 2 * MB);
+	ConcurrentFree(p3);
+
+	// 还回来的3MB与剩下的1MB合并，可以满足4MB
+	void* p5 = ConcurrentAlloc(4 * MB);
+	assert(p5 == p1);
+	ConcurrentFree(p5);
+	ConcurrentFree(p4);
+
+	// 对齐的申请也可以从缓存中切
+	void* p6 = ConcurrentAllocAligned(2 * MB, 2 * MB);
+	assert(((uintptr_t)p6 & (2 * MB - 1)) == 0);
+	ConcurrentFree(p6);
+
+	// 超过上限的部分还给系统
+	PageCache::GetInstance()->SetLargeCacheLimit(0);
+	MallocStats after;
+	ConcurrentGetStats(after);
+	assert(after._large_cache_bytes == 0);
+	assert(after._mapped_bytes == before._mapped_bytes);
+	PageCache::GetInstance()->SetLargeCacheLimit(64 * MB);
+
+	// best-fit：缓存里有不相邻的5MB和3MB，2MB从3MB的那个切
+	void* big = ConcurrentAlloc(5 * MB);
+	void* guard1 = ConcurrentAlloc(2 * MB);
+	void* mid = ConcurrentAlloc(3 * MB);
+	void* guard2 = ConcurrentAlloc(2 * MB);
+	ConcurrentFree(big);
+	ConcurrentFree(mid);
+	void* fit = ConcurrentAlloc(2 * MB);
+	assert(fit == mid);
+	ConcurrentFree(fit);
+	ConcurrentFree(guard1);
+	ConcurrentFree(guard2);
+
+	// 后台回收线程也会把缓存里的span还给系统
+	ConcurrentGetStats(before);
+	assert(before._large_cache_bytes > 0);
+	PageCache::GetInstance()->SetReleaseRate((size_t)1 << 30);
+	for (int i = 0; i < 100; ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		ConcurrentGetStats(after);
+		if (after._large_cache_bytes == 0)
+			break;
+	}
+	PageCache::GetInstance()->SetReleaseRate(0);
+	assert(after._large_cache_bytes == 0);
+	assert(after._mapped_bytes + before._large_cache_bytes <= before._mapped_bytes);
+}
+
+void TestMallocStats()
+{
+	const size_t kSize = 5000;
+	const size_t kNum = 1000;
+	size_t index = SizeClass::Index(kSize);
+
+	MallocStats before;
+	ConcurrentGetStats(before);
+
+	// 在一个已经退出的线程里申请，计数要并入已回收的部分
+	std::vector<void*> ptrs(kNum);
+	std::thread t([&]() {
+		for (size_t i = 0; i < kNum; ++i)
+			ptrs[i] = ConcurrentAlloc(kSize);
+	});
+	t.join();
+
+	void* big = ConcurrentAlloc(2 * MAX_BYTES);
+
+	MallocStats stats;
+	ConcurrentGetStats(stats);
+	const SizeClassStats& cls = stats._classes[index];
+	assert(cls._size == SizeClass::ClassSize(index));
+	assert(cls._alloc_count - before._classes[index]._alloc_count == kNum);
+	assert(cls._live_objects >= kNum);
+	assert(cls._span_count > 0);
+	assert(stats._large_alloc_count == before._large_alloc_count + 1);
+	assert(stats._large_in_use_bytes >= 2 * MAX_BYTES);
+	assert(stats._small_in_use_bytes >= kNum * cls._size);
+	assert(stats._mapped_bytes >= stats._small_in_use_bytes + stats._large_in_use_bytes);
+	assert(stats._internal_fragmentation_bytes > 0);
+
+	for (size_t i = 0; i < kNum; ++i)
+		ConcurrentFree(ptrs[i]);
+	ConcurrentFree(big);
+
+	MallocStats after;
+	ConcurrentGetStats(after);
+	assert(after._classes[index]._free_count - before._classes[index]._free_count == kNum);
+	assert(after._classes[index]._live_objects == before._classes[index]._live_objects);
+	assert(after._large_free_count == before._large_free_count + 1);
+
+	// 输出里的数字就是stats里的值，用过的桶各占一行/一项
+	std::string text = ConcurrentStatsText(after);
+	std::string json = ConcurrentStatsJson(after);
+	const SizeClassStats& done = after._classes[index];
+	char line[256];
+
+	snprintf(line, sizeof(line), "MALLOC: %12zu (%8.1f MiB) Bytes mapped from system\n",
+		after._mapped_bytes, after._mapped_bytes / (1024.0 * 1024.0));
+	assert(text.find(line) != std::string::npos);
+	snprintf(line, sizeof(line), "MALLOC: %12llu Large allocations, %llu large frees",
+		(unsigned long long)after._large_alloc_count, (unsigned long long)after._large_free_count);
+	assert(text.find(line) != std::string::npos);
+	snprintf(line, sizeof(line), "\n%5zu %8zu %12llu %12llu ",
+		index, done._size, (unsigned long long)done._alloc_count, (unsigned long long)done._free_count);
+	assert(text.find(line) != std::string::npos);
+
+	assert(json.front() == '{' && json.back() == '}');
+	snprintf(line, sizeof(line), "{\"mapped_bytes\":%zu,", after._mapped_bytes);
+	assert(json.compare(0, strlen(line), line) == 0);
+	snprintf(line, sizeof(line), "\"large_free_count\":%llu,", (unsigned long long)after._large_free_count);
+	assert(json.find(line) != std::string::npos);
+	snprintf(line, sizeof(line), "{\"class\":%zu,\"size\":%zu,\"alloc_count\":%llu,\"free_count\":%llu,",
+		index, done._size, (unsigned long long)done._alloc_count, (unsigned long long)done._free_count);
+	assert(json.find(line) != std::string::npos);
+	assert(json.find("\"size_classes\":[{") != std::string::npos);
+}
+
+// 单独一个函数，采样到的调用栈都经过它
+static void* ProfiledAlloc(size_t size)
+{
+	return ConcurrentAlloc(size);
+}
+
+void TestHeapProfiler()
+{
+	const size_t kNum = 2000;
+	std::vector<void*> ptrs(kNum);
+
+	// 采样间隔比对象小，几乎每个对象都会被采样
+	ConcurrentSetHeapSamplePeriod(1024);
+	for (size_t i = 0; i < kNum; ++i)
+	{
+		size_t size = (i % 2 == 0) ? 3000 : 300 * 1024;
+		ptrs[i] = ProfiledAlloc(size);
+		memset(ptrs[i], 0x5A, size);
+		assert(ConcurrentUsableSize(ptrs[i]) >= size);
+	}
+	ConcurrentSetHeapSamplePeriod(0);
+	assert(HeapProfiler::HasSmallSamples());
+
+	std::string profile = ConcurrentHeapProfile();
+	assert(profile.compare(0, 14, "heap profile: ") == 0);
+	assert(profile.find("@ heap_v2/1024") != std::string::npos);
+	assert(profile.find("MAPPED_LIBRARIES:") != std::string::npos);
+
+	unsigned long long inuse = 0, inuse_bytes = 0, alloc = 0, alloc_bytes = 0;
+	sscanf(profile.c_str(), "heap profile: %llu: %llu [%llu: %llu]", &inuse, &inuse_bytes, &alloc, &alloc_bytes);
+	assert(inuse > kNum / 2 && inuse <= alloc);
+	assert(inuse_bytes > 0);
+
+	// 被采样的对象走有尺寸和无尺寸的释放都可以
+	for (size_t i = 0; i < kNum; ++i)
+	{
+		if (i % 4 == 0)
+			ConcurrentFree(ptrs[i], 3000);
+		else
+			ConcurrentFree(ptrs[i]);
+	}
+
+	unsigned long long inuse_after = 0, inuse_bytes_after = 0;
+	profile = ConcurrentHeapProfile();
+	sscanf(profile.c_str(), "heap profile: %llu: %llu", &inuse_after, &inuse_bytes_after);
+	assert(inuse_after + inuse <= alloc);
+	assert(inuse_bytes_after < inuse_bytes);
+
+	// 被采样的小对象都释放了，有尺寸的释放回到不查span的快路径
+	assert(!HeapProfiler::HasSmallSamples());
+
+	// 批量申请与逐个申请的采样率一致：一批越过多少次采样间隔就采样多少个对象
+	// 刚重新打开采样时线程可能还在走关闭期间的2MB检查间隔，一批3MB保证后1MB按1024字节的间隔采样
+	const size_t kBatch = 1024;
+	std::vector<void*> batch(kBatch);
+	ConcurrentSetHeapSamplePeriod(1024);
+	ConcurrentAllocBatch(3000, kBatch, batch.data());
+	ConcurrentSetHeapSamplePeriod(0);
+
+	unsigned long long inuse_batch = 0;
+	profile = ConcurrentHeapProfile();
+	sscanf(profile.c_str(), "heap profile: %llu", &inuse_batch);
+	assert(inuse_batch >= inuse_after + kBatch / 4);
+
+	ConcurrentFreeBatch(batch.data(), kBatch, 3000);
+	assert(!HeapProfiler::HasSmallSamples());
+}
+
+struct alignas(64) PoolNode
+{
+	size_t _key;
+	std::string _name;
+	PoolNode* _next = nullptr;
+
+	PoolNode(size_t key, const std::string& name)
+		: _key(key)
+		, _name(name)
+	{}
+};
+
+// 构造参数转发、按alignof(T)对齐、批量申请/释放
+void TestObjectPool()
+{
+	static_assert(ObjectPool<PoolNode>::ObjSize() % 64 == 0, "");
+	static_assert(ObjectPool<char>::ObjSize() == sizeof(void*), "");
+
+	ObjectPool<PoolNode> pool;
+	PoolNode* node = pool.New(7, std::string("seven"));
+	assert(((uintptr_t)node & 63) == 0);
+	assert(node->_key == 7 && node->_name == "seven");
+	pool.Delete(node);
+
+	// 跨越多个大块
+	const size_t n = ObjectPool<PoolNode>::ChunkBytes() / ObjectPool<PoolNode>::ObjSize() * 3 + 5;
+	std::vector<PoolNode*> nodes(n);
+	pool.NewN(nodes.data(), n, (size_t)42, std::string("bulk"));
+	for (PoolNode* p : nodes)
+	{
+		assert(((uintptr_t)p & 63) == 0);
+		assert(p->_key == 42 && p->_name == "bulk");
+	}
+	std::vector<PoolNode*> sorted(nodes);
+	std::sort(sorted.begin(), sorted.end());
+	assert(std::unique(sorted.begin(), sorted.end()) == sorted.end());
+
+	// 整批还回去之后再整批拿出来，得到的还是同一批空间
+	pool.DeleteN(nodes.data(), n);
+	std::vector<PoolNode*> again(n);
+	pool.NewN(again.data(), n, (size_t)1, std::string());
+	std::sort(again.begin(), again.end());
+	assert(again == sorted);
+	pool.DeleteN(again.data(), n);
+}
+
+struct PoolMessage
+{
+	size_t _magic = 0x5A5A5A5A;
+	size_t _owner = 0;
+	char _payload[40];
+};
+
+// 多个线程同时New/Delete，一部分对象交给别的线程释放，magazine在线程和depot之间流转
+void TestConcurrentObjectPool()
+{
+	static ConcurrentObjectPool<PoolMessage> pool;
+	const size_t kThreads = 4;
+	const size_t kRounds = 200;
+	const size_t kBatch = 100;
+
+	std::mutex mtx;
+	std::vector<PoolMessage*> handoff;
+
+	std::vector<std::thread> vthread;
+	for (size_t t = 0; t < kThreads; ++t)
+	{
+		vthread.emplace_back([&, t]() {
+			std::vector<PoolMessage*> v(kBatch);
+			for (size_t r = 0; r < kRounds; ++r)
+			{
+				for (auto& m : v)
+				{
+					m = pool.New();
+					assert(m->_magic == 0x5A5A5A5A && m->_owner == 0);
+					m->_owner = t + 1;
+				}
+
+				// 同时存活的对象不能重复
+				std::vector<PoolMessage*> sorted(v);
+				std::sort(sorted.begin(), sorted.end());
+				assert(std::unique(sorted.begin(), sorted.end()) == sorted.end());
+
+				for (auto m : v)
+					assert(m->_owner == t + 1);
+
+				// 一半自己释放，一半交给别的线程，再释放别的线程交过来的
+				for (size_t i = 0; i < kBatch / 2; ++i)
+					pool.Delete(v[i]);
+
+				std::vector<PoolMessage*> others;
+				{
+					std::unique_lock<std::mutex> lock(mtx);
+					others.swap(handoff);
+					handoff.insert(handoff.end(), v.begin() + kBatch / 2, v.end());
+				}
+				for (auto m : others)
+					pool.Delete(m);
+			}
+		});
+	}
+
+	for (auto& t : vthread)
+		t.join();
+
+	for (auto m : handoff)
+		pool.Delete(m);
+}
+
+// 短命的池先于线程销毁：同一地址上新建的池不能接手旧池留在线程里的magazine，线程退出时也不再碰旧池
+void TestShortLivedObjectPool()
+{
+	std::thread([]() {
+		const size_t kObjs = 64;
+		std::vector<void*> seen;
+		for (int round = 0; round < 10; ++round)
+		{
+			ConcurrentObjectPool<PoolMessage> pool;
+			PoolMessage* objs[kObjs];
+			for (PoolMessage*& m : objs)
+			{
+				m = pool.New();
+				assert(std::find(seen.begin(), seen.end(), (void*)m) == seen.end());
+				m->_owner = round;
+			}
+			for (PoolMessage* m : objs)
+			{
+				assert(m->_owner == (size_t)round);
+				pool.Delete(m);
+				seen.push_back(m);
+			}
+		}
+	}).join();
+}
+
+// 在单节点的机器上模拟4个NUMA节点
+void TestNuma()
+{
+	Numa::SimulateNodes(4);
+	assert(Numa::NumNodes() == 4);
+
+	// 固定在节点1的线程，小对象和大对象都来自节点1的实例
+	const size_t kNum = 2000;
+	std::vector<void*> ptrs(kNum);
+	void* big = nullptr;
+	std::thread t1([&]() {
+		Numa::SetThreadNode(1);
+		for (size_t i = 0; i < kNum; ++i)
+			ptrs[i] = ConcurrentAlloc(48);
+		big = ConcurrentAlloc(2 * MAX_BYTES);
+	});
+	t1.join();
+
+	PageCache* pc = PageCache::GetInstance();
+	for (void* p : ptrs)
+		assert(pc->MapObjectToSpan(p)->_node == 1);
+	assert(pc->MapObjectToSpan(big)->_node == 1);
+
+	// 在节点2的线程里释放，对象要还给节点1，不能被节点2的线程再拿去用
+	std::thread t2([&]() {
+		Numa::SetThreadNode(2);
+		for (void* p : ptrs)
+			ConcurrentFree(p);
+		ConcurrentFree(big);
+	});
+	t2.join();
+
+	std::thread t3([&]() {
+		Numa::SetThreadNode(2);
+		for (size_t i = 0; i < kNum; ++i)
+		{
+			ptrs[i] = ConcurrentAlloc(48);
+			assert(PageCache::GetInstance()->MapObjectToSpan(ptrs[i])->_node == 2);
+		}
+		for (void* p : ptrs)
+			ConcurrentFree(p);
+	});
+	t3.join();
+
+	// 节点3还没有空闲span，允许借用时从其它节点的空闲链表切，不向系统申请
+	ConcurrentSetNumaStealPolicy(NumaStealPolicy::BeforeSystem);
+	MallocStats before;
+	ConcurrentGetStats(before);
+
+	std::thread t4([&]() {
+		Numa::SetThreadNode(3);
+		void* p = ConcurrentAlloc(64 * 1024);
+		assert(PageCache::GetInstance()->MapObjectToSpan(p)->_node == 3);
+		ConcurrentFree(p);
+	});
+	t4.join();
+
+	MallocStats after;
+	ConcurrentGetStats(after);
+	assert(after._mapped_bytes == before._mapped_bytes);
+	ConcurrentSetNumaStealPolicy(NumaStealPolicy::Never);
+}
+
+// 多个节点的线程同时申请/释放，一半的对象交给别的节点的线程释放，允许节点之间借用空闲span
+// 覆盖跨节点的归还、借用时改_node、相邻span在节点之间不合并，用ThreadSanitizer跑应当没有报告
+void TestNumaStress()
+{
+	const size_t kThreads = 4;
+	const size_t kRounds = 300;
+
+	ConcurrentSetNumaStealPolicy(NumaStealPolicy::BeforeSystem);
+
+	std::mutex mtx;
+	std::vector<std::pair<char*, size_t>> shared;	// 等别的节点来释放的对象
+
+	std::vector<std::thread> vthread;
+	for (size_t t = 0; t < kThreads; ++t)
+	{
+		vthread.emplace_back([&, t]() {
+			Numa::SetThreadNode((int)(t % Numa::NumNodes()));
+
+			std::vector<std::pair<char*, size_t>> mine;
+			for (size_t i = 0; i < kRounds; ++i)
+			{
+				size_t r = (i * 7919 + t * 104729) % 100;
+				size_t size = r < 80 ? 16 + r * 97				// 小对象
+					: r < 97 ? (33 + r) * 8 * 1024				// 不超过128页
+					: (129 + r) * 8 * 1024;						// 超过128页
+				char* ptr = (char*)ConcurrentAlloc(size);
+				ptr[0] = (char)t;
+				ptr[size - 1] = (char)t;
+				if (i % 2 == 0)
+				{
+					mine.emplace_back(ptr, size);
+				}
+				else
+				{
+					std::unique_lock<std::mutex> lock(mtx);
+					shared.emplace_back(ptr, size);
+				}
+
+				if (mine.size() > 16)
+				{
+					auto e = mine.front();
+					assert(e.first[0] == (char)t && e.first[e.second - 1] == (char)t);
+					ConcurrentFree(e.first);
+					mine.erase(mine.begin());
+				}
+
+				// 释放别的节点交出来的对象
+				std::vector<std::pair<char*, size_t>> others;
+				{
+					std::unique_lock<std::mutex> lock(mtx);
+					if (shared.size() > 32)
+						others.swap(shared);
+				}
+				for (auto& e : others)
+				{
+					assert(e.first[0] == e.first[e.second - 1]);
+					ConcurrentFree(e.first);
+				}
+			}
+
+			for (auto& e : mine)
+				ConcurrentFree(e.first);
+		});
+	}
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+
+	for (auto& e : shared)
+	{
+		ConcurrentFree(e.first);
+	}
+	ConcurrentSetNumaStealPolicy(NumaStealPolicy::Never);
+}
+
+int main()
+{
+	TestSizeClass();
+	TestPageMap();
+	TLSTest();
+	TestConcurrentAlloc1();
+	TestConcurrentAlloc2();
+	TestBigAlloc();
+	TestMultiThread();
+	TestMultiThreadBigAlloc();
+	TestThreadExit();
+	TestReleaseFreePages();
+	TestTransferCache();
+	TestTransferCachePlunder();
+	TestSpanCarving();
+	TestNewDelete();
+	TestAlignedAlloc();
+	TestRealloc();
+	TestBatchAlloc();
+	TestThreadCacheBudget();
+	TestConcurrentAllocator();
+	TestLargeObjectCache();
+	TestMallocStats();
+	TestHeapProfiler();
+	TestObjectPool();
+	TestConcurrentObjectPool();
+	TestShortLivedObjectPool();
+	TestNuma();			// 节点数只能增加，之后的用例都在多节点下运行
+	TestNumaStress();
+	TestPerCpuCache();  // 会切换全局前端，放在最后
+
+	cout << "UnitTest passed" << endl;
+
+	return 0;
+}